@@ -0,0 +1,323 @@
+/*==========================================================================
+gettags
+batch.c
+Copyright (c)2012-2024 Kevin Boone
+Distributed under the terms of the GNU Public Licence, v3.0
+==========================================================================*/
+
+/*
+ * Files are dealt to the workers in turn, each worker having a queue of
+ * its own, so that the workers don't all contend for one lock. A worker
+ * whose queue is empty steals from another's. Both take the oldest file
+ * in the queue, rather than the newest as is usual with work stealing,
+ * because output can't be written until the files before it are done.
+ *
+ * Each file has a slot in a ring of BATCH_QUEUE_SIZE slots for each
+ * worker, where its output waits. A file can only be added when its
+ * slot is free, so no queue can hold more than BATCH_QUEUE_SIZE files.
+ * Whichever worker finishes the oldest unwritten file writes its output,
+ * and that of any files after it that are done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "types.h"
+#include "batch.h"
+
+#define BATCH_QUEUE_SIZE 64
+
+typedef struct
+  {
+  pthread_mutex_t lock;
+  long files[BATCH_QUEUE_SIZE]; // Sequence numbers, oldest at head
+  int head;
+  int count;
+  } BatchQueue;
+
+typedef struct
+  {
+  char *file;
+  char *out;
+  size_t out_len;
+  char *err;
+  size_t err_len;
+  BOOL failed;      // Out of memory before the file could be processed
+  BOOL done;
+  } BatchSlot;
+
+typedef struct
+  {
+  Batch *batch;
+  int index;
+  pthread_t thread;
+  } BatchWorker;
+
+struct _Batch
+  {
+  int jobs;
+  int threads;      // Workers that were started
+  BatchFunc func;
+  void *data;
+  void *(*worker_new) (void);
+  void (*worker_free) (void *);
+  BatchWorker *workers;
+  BatchQueue *queues;
+  BatchSlot *slots;
+  long window;      // Number of slots
+  // These are protected by lock
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // There are files in the queues, or no more to come
+  pthread_cond_t room;  // A slot has been freed
+  long next_file;   // Sequence number of the next file to be added
+  long next_write;  // Sequence number of the next file to be written
+  long queued;      // Files in the queues
+  int idle;         // Workers waiting for work
+  BOOL adder_waiting; // batch_add() is waiting for room
+  BOOL finished;    // No more files will be added
+  };
+
+/*
+ * Take the oldest file from a queue, if it has one
+ */
+static BOOL batch_queue_take (BatchQueue *q, long *seq)
+  {
+  BOOL ret = FALSE;
+  pthread_mutex_lock (&q->lock);
+  if (q->count > 0)
+    {
+    *seq = q->files[q->head];
+    q->head = (q->head + 1) % BATCH_QUEUE_SIZE;
+    q->count--;
+    ret = TRUE;
+    }
+  pthread_mutex_unlock (&q->lock);
+  return ret;
+  }
+
+/*
+ * Get a file for worker w from its own queue or, failing that, from the
+ * others', starting with the next worker's. Returns FALSE if all the
+ * queues are empty.
+ */
+static BOOL batch_take (Batch *batch, int w, long *seq)
+  {
+  int i;
+  for (i = 0; i < batch->jobs; i++)
+    {
+    if (batch_queue_take (&batch->queues[(w + i) % batch->jobs], seq))
+      {
+      __atomic_fetch_sub (&batch->queued, 1, __ATOMIC_RELAXED);
+      return TRUE;
+      }
+    }
+  return FALSE;
+  }
+
+/*
+ * Mark a file done, and write the output of as many files as are ready.
+ * Must be called with the batch locked.
+ */
+static void batch_done (Batch *batch, long seq)
+  {
+  batch->slots[seq % batch->window].done = TRUE;
+  if (seq != batch->next_write) return;
+
+  BatchSlot *slot;
+  while ((slot = &batch->slots[batch->next_write % batch->window])->done)
+    {
+    fwrite (slot->out, 1, slot->out_len, stdout);
+    if (slot->err_len)
+      {
+      fflush (stdout);
+      fwrite (slot->err, 1, slot->err_len, stderr);
+      }
+    if (slot->failed)
+      {
+      fflush (stdout);
+      batch->func (slot->file, NULL, stderr, batch->data, NULL);
+      }
+    free (slot->file);
+    free (slot->out);
+    free (slot->err);
+    memset (slot, 0, sizeof (BatchSlot));
+    batch->next_write++;
+    }
+  if (batch->adder_waiting) pthread_cond_signal (&batch->room);
+  }
+
+static void *batch_worker (void *arg)
+  {
+  BatchWorker *worker = arg;
+  Batch *batch = worker->batch;
+  void *worker_data = batch->worker_new ? batch->worker_new () : NULL;
+
+  while (1)
+    {
+    long seq;
+    if (!batch_take (batch, worker->index, &seq))
+      {
+      pthread_mutex_lock (&batch->lock);
+      while (__atomic_load_n (&batch->queued, __ATOMIC_RELAXED) == 0
+          && !batch->finished)
+        {
+        batch->idle++;
+        pthread_cond_wait (&batch->work, &batch->lock);
+        batch->idle--;
+        }
+      BOOL all_done = batch->finished
+        && __atomic_load_n (&batch->queued, __ATOMIC_RELAXED) == 0;
+      pthread_mutex_unlock (&batch->lock);
+      if (all_done) break;
+      continue;
+      }
+
+    BatchSlot *slot = &batch->slots[seq % batch->window];
+    FILE *out = open_memstream (&slot->out, &slot->out_len);
+    FILE *err = open_memstream (&slot->err, &slot->err_len);
+    if (out && err)
+      batch->func (slot->file, out, err, batch->data, worker_data);
+    if (out) fclose (out);
+    if (err) fclose (err);
+    if (!out || !err)
+      {
+      // batch_done() has func report it, in its turn
+      free (slot->out);
+      free (slot->err);
+      slot->out = slot->err = NULL;
+      slot->out_len = slot->err_len = 0;
+      slot->failed = TRUE;
+      }
+
+    pthread_mutex_lock (&batch->lock);
+    batch_done (batch, seq);
+    pthread_mutex_unlock (&batch->lock);
+    }
+
+  if (batch->worker_free) batch->worker_free (worker_data);
+  return NULL;
+  }
+
+/*
+ * Start jobs workers, each of which calls worker_new, if it is not NULL,
+ * to make the worker_data that it passes to func, and worker_free when
+ * it finishes. Returns NULL if we run out of memory, or can't start the
+ * threads.
+ */
+Batch *batch_new (int jobs, BatchFunc func, void *data,
+    void *(*worker_new) (void), void (*worker_free) (void *))
+  {
+  Batch *batch = calloc (1, sizeof (Batch));
+  if (!batch) return NULL;
+  batch->jobs = jobs;
+  batch->func = func;
+  batch->data = data;
+  batch->worker_new = worker_new;
+  batch->worker_free = worker_free;
+  batch->window = (long)jobs * BATCH_QUEUE_SIZE;
+  batch->workers = calloc (jobs, sizeof (BatchWorker));
+  batch->queues = calloc (jobs, sizeof (BatchQueue));
+  batch->slots = calloc (batch->window, sizeof (BatchSlot));
+  if (!batch->workers || !batch->queues || !batch->slots)
+    {
+    free (batch->workers);
+    free (batch->queues);
+    free (batch->slots);
+    free (batch);
+    return NULL;
+    }
+  pthread_mutex_init (&batch->lock, NULL);
+  pthread_cond_init (&batch->work, NULL);
+  pthread_cond_init (&batch->room, NULL);
+
+  int i;
+  for (i = 0; i < jobs; i++)
+    pthread_mutex_init (&batch->queues[i].lock, NULL);
+  for (i = 0; i < jobs; i++)
+    {
+    batch->workers[i].batch = batch;
+    batch->workers[i].index = i;
+    if (pthread_create (&batch->workers[i].thread, NULL, batch_worker,
+        &batch->workers[i]) != 0)
+      {
+      // Let the ones that did start finish, and give up
+      batch_finish (batch);
+      return NULL;
+      }
+    batch->threads++;
+    }
+  return batch;
+  }
+
+/*
+ * Add a file to be processed. The name is copied. This waits if the
+ * workers are too far behind.
+ */
+void batch_add (Batch *batch, const char *file)
+  {
+  pthread_mutex_lock (&batch->lock);
+  while (batch->next_file >= batch->next_write + batch->window)
+    {
+    batch->adder_waiting = TRUE;
+    pthread_cond_wait (&batch->room, &batch->lock);
+    batch->adder_waiting = FALSE;
+    }
+  long seq = batch->next_file++;
+  pthread_mutex_unlock (&batch->lock);
+
+  // The slot is free, and no worker can look at it until it's queued
+  BatchSlot *slot = &batch->slots[seq % batch->window];
+  slot->file = strdup (file ? file : "");
+  if (!slot->file)
+    {
+    // There's no point in queueing it, but it still has to be reported,
+    //  and written in its turn, or nothing after it would be
+    pthread_mutex_lock (&batch->lock);
+    slot->failed = TRUE;
+    batch_done (batch, seq);
+    pthread_mutex_unlock (&batch->lock);
+    return;
+    }
+
+  // Files go to the queues in turn, so each holds files whose sequence
+  //  numbers are jobs apart, and there is always room
+  BatchQueue *q = &batch->queues[seq % batch->jobs];
+  pthread_mutex_lock (&q->lock);
+  q->files[(q->head + q->count) % BATCH_QUEUE_SIZE] = seq;
+  q->count++;
+  pthread_mutex_unlock (&q->lock);
+
+  pthread_mutex_lock (&batch->lock);
+  __atomic_fetch_add (&batch->queued, 1, __ATOMIC_RELAXED);
+  if (batch->idle) pthread_cond_signal (&batch->work);
+  pthread_mutex_unlock (&batch->lock);
+  }
+
+/*
+ * Wait for all the files to be processed and their output written, and
+ * free the batch
+ */
+void batch_finish (Batch *batch)
+  {
+  pthread_mutex_lock (&batch->lock);
+  batch->finished = TRUE;
+  pthread_cond_broadcast (&batch->work);
+  pthread_mutex_unlock (&batch->lock);
+
+  int i;
+  for (i = 0; i < batch->threads; i++)
+    pthread_join (batch->workers[i].thread, NULL);
+  fflush (stdout);
+
+  pthread_mutex_destroy (&batch->lock);
+  pthread_cond_destroy (&batch->work);
+  pthread_cond_destroy (&batch->room);
+  for (i = 0; i < batch->jobs; i++)
+    pthread_mutex_destroy (&batch->queues[i].lock);
+  free (batch->workers);
+  free (batch->queues);
+  free (batch->slots);
+  free (batch);
+  }
+
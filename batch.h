@@ -0,0 +1,34 @@
+/*==========================================================================
+gettags
+batch.h
+Copyright (c)2012-2024 Kevin Boone
+Distributed under the terms of the GNU Public Licence, v3.0
+==========================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+
+/* A Batch processes files on a pool of worker threads, but writes their
+ * output in the order that the files were added, as if they had been
+ * processed one at a time. Each file's output is collected in memory
+ * until it's the file's turn to be written; only a limited number of
+ * files can be waiting, so batch_add() blocks if the workers fall
+ * behind. */
+typedef struct _Batch Batch;
+
+/* Process one file, writing to out rather than stdout, and err rather
+ * than stderr. worker_data is what the batch's worker_new function
+ * returned for the thread that is doing the work. If there isn't the
+ * memory to collect the file's output, func is instead called with out
+ * and worker_data NULL, and err stderr, when it is the file's turn to be
+ * written, to say so; file is NULL too if even its name couldn't be
+ * copied. */
+typedef void (*BatchFunc) (const char *file, FILE *out, FILE *err,
+                 void *data, void *worker_data);
+
+Batch     *batch_new (int jobs, BatchFunc func, void *data,
+              void *(*worker_new) (void), void (*worker_free) (void *));
+void       batch_add (Batch *batch, const char *file);
+void       batch_finish (Batch *batch);
+
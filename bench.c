@@ -0,0 +1,247 @@
+/*==========================================================================
+gettags
+bench.c
+Copyright (c)2012-2024 Kevin Boone
+Distributed under the terms of the GNU Public Licence, v3.0
+==========================================================================*/
+
+/*
+ * Microbenchmarks for the tag reader's text conversions. These need the
+ * reader's static functions, so the reader is included here, rather than
+ * linked. Run with "make bench".
+ */
+
+#include "tag_reader.c"
+#include <time.h>
+
+#define BENCH_TEXT_UNITS 64
+#define BENCH_ROUNDS 10
+
+/*
+ * The UTF-16 conversion as it was before it was vectorized, for
+ * comparison: the whole text through the Unicode Consortium code, into a
+ * worst-case buffer. It assumes that the text is little-endian, and
+ * aligned.
+ */
+static char *old_convert_utf16_to_utf8 (TagArena *arena, int has_bom,
+    const UTF16 *s, int len)
+{
+  int utf8_len = len * 2;
+  UTF8 *target = (UTF8 *) tag_arena_alloc (arena, utf8_len);
+  if (!target) return NULL;
+  memset (target, 0, utf8_len);
+  UTF8 *t = target;
+  const UTF16 *start = s;
+  int utf16_len = len / sizeof (UTF16);
+  if (has_bom)
+    {
+    utf16_len--;
+    start++;
+    }
+  UTFConversionResult ret = _convert_utf16_to_utf8
+    (&start, start + utf16_len, &t, t + utf8_len);
+  if (ret != conversionOK )
+    strncpy ((char *)target, "Unicode error", utf8_len - 1);
+  tag_arena_shrink (arena, target, utf8_len, strlen ((char *)target) + 1);
+  return (char*) target;
+}
+
+/*
+ * The ISO-8859-1 conversion before it was vectorized: a byte at a time,
+ * into a worst-case buffer.
+ */
+static unsigned char *old_convert_iso8859_to_utf8 
+  (TagArena *arena, const unsigned char *s, int len)
+{
+  unsigned char *buff = (unsigned char *) tag_arena_alloc (arena, len * 2 + 1);
+  if (!buff) return NULL;
+  memset (buff, 0, len * 2 + 1);
+  unsigned char *out = buff;
+  
+  int i = 0;
+  while (i < len)
+  {
+    if (s[i] < 128) { *out++ = s[i]; }
+    else { *out++ = (0xc2+(s[i]>0xbf)); *out++ = ((s[i]&0x3f)+0x80); }
+  i++;
+  }
+  tag_arena_shrink (arena, buff, len * 2 + 1, out - buff + 1);
+  return buff;
+}
+
+static double bench_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+/*
+ * Make a little-endian UTF-16 frame body, with a BOM and a terminator,
+ * whose text repeats the characters in sample
+ */
+static int bench_make_utf16 (BYTE *buff, const UTF16 *sample, int n)
+  {
+  int i, len = 0;
+  buff[len++] = 0xFF; buff[len++] = 0xFE;
+  for (i = 0; i < BENCH_TEXT_UNITS; i++)
+    {
+    buff[len++] = sample[i % n] & 0xFF;
+    buff[len++] = sample[i % n] >> 8;
+    }
+  buff[len++] = 0; buff[len++] = 0;
+  return len;
+  }
+
+static void bench_utf16 (const char *label, const UTF16 *sample, int n)
+  {
+  static UTF16 aligned[BENCH_TEXT_UNITS + 2];
+  BYTE *buff = (BYTE *)aligned;
+  int len = bench_make_utf16 (buff, sample, n);
+  const int iterations = 200000;
+  TagArena *arena = tag_arena_new ();
+  int i;
+
+  // The frame body starts at an odd offset, so the new code gets that
+  BYTE *frame = malloc (len + 1);
+  memcpy (frame + 1, buff, len);
+
+  char *a = old_convert_utf16_to_utf8 (arena, TRUE, aligned, len);
+  char *b = tag_convert_utf16_to_utf8 (arena, TRUE, frame + 1, len);
+  if (strcmp (a, b) != 0)
+    printf ("%s: results differ!\n", label);
+
+  // Take the best of several rounds, to leave out interruptions
+  double old_time = 1e9, new_time = 1e9;
+  int round;
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+    double start = bench_now ();
+    for (i = 0; i < iterations; i++)
+      {
+      if (i % 1000 == 0) tag_arena_reset (arena);
+      old_convert_utf16_to_utf8 (arena, TRUE, aligned, len);
+      }
+    double t = bench_now () - start;
+    if (t < old_time) old_time = t;
+
+    start = bench_now ();
+    for (i = 0; i < iterations; i++)
+      {
+      if (i % 1000 == 0) tag_arena_reset (arena);
+      tag_convert_utf16_to_utf8 (arena, TRUE, frame + 1, len);
+      }
+    t = bench_now () - start;
+    if (t < new_time) new_time = t;
+    }
+
+  printf ("UTF-16 %-10s old %6.1f ns  new %6.1f ns  (x%.1f)\n", label,
+    old_time / iterations * 1e9, new_time / iterations * 1e9,
+    old_time / new_time);
+  free (frame);
+  tag_arena_free (arena);
+  }
+
+static void bench_latin1 (const char *label, const char *sample)
+  {
+  BYTE text[BENCH_TEXT_UNITS];
+  int n = strlen (sample);
+  const int iterations = 200000;
+  TagArena *arena = tag_arena_new ();
+  int i;
+
+  for (i = 0; i < BENCH_TEXT_UNITS; i++)
+    text[i] = sample[i % n];
+
+  char *a = (char *)old_convert_iso8859_to_utf8 (arena, text, 
+    BENCH_TEXT_UNITS);
+  char *b = (char *)tag_convert_iso8859_to_utf8 (arena, text, 
+    BENCH_TEXT_UNITS);
+  if (strcmp (a, b) != 0)
+    printf ("%s: results differ!\n", label);
+
+  double old_time = 1e9, new_time = 1e9;
+  int round;
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+    double start = bench_now ();
+    for (i = 0; i < iterations; i++)
+      {
+      if (i % 1000 == 0) tag_arena_reset (arena);
+      old_convert_iso8859_to_utf8 (arena, text, BENCH_TEXT_UNITS);
+      }
+    double t = bench_now () - start;
+    if (t < old_time) old_time = t;
+
+    start = bench_now ();
+    for (i = 0; i < iterations; i++)
+      {
+      if (i % 1000 == 0) tag_arena_reset (arena);
+      tag_convert_iso8859_to_utf8 (arena, text, BENCH_TEXT_UNITS);
+      }
+    t = bench_now () - start;
+    if (t < new_time) new_time = t;
+    }
+
+  printf ("Latin-1 %-9s old %6.1f ns  new %6.1f ns  (x%.1f)\n", label,
+    old_time / iterations * 1e9, new_time / iterations * 1e9,
+    old_time / new_time);
+  tag_arena_free (arena);
+  }
+
+/*
+ * What it costs to check text that is valid UTF-8, which is what it 
+ * costs to read a tag with tag_utf8_repair set
+ */
+static void bench_utf8_check (const char *label, const char *sample)
+  {
+  BYTE text[BENCH_TEXT_UNITS];
+  int n = strlen (sample);
+  const int iterations = 200000;
+  int i, valid = 0;
+
+  // Only whole copies of the sample, so as not to split a character
+  for (i = 0; i + n <= BENCH_TEXT_UNITS; i += n)
+    memcpy (text + i, sample, n);
+  n = i;
+
+  double best = 1e9;
+  int round;
+  for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+    double start = bench_now ();
+    for (i = 0; i < iterations; i++)
+      valid += tag_text_vector ()->utf8_valid (text, n);
+    double t = bench_now () - start;
+    if (t < best) best = t;
+    }
+
+  if (valid != iterations * BENCH_ROUNDS)
+    printf ("%s: not valid!\n", label);
+  printf ("UTF-8 check %-8s %6.1f ns\n", label, best / iterations * 1e9);
+  }
+
+int main (void)
+  {
+  static const UTF16 ascii[] = { 'T', 'h', 'e', ' ', 'W', 'a', 'l', 'l' };
+  static const UTF16 latin[] = { 'M', 0xFC, 'n', 'c', 'h', 'e', 'n', ' ' };
+  static const UTF16 cjk[] = { 0x6771, 0x4EAC, 0x3067, 0x3059 };
+  static const UTF16 emoji[] = { 'a', 0xD83C, 0xDFB5, ' ' };
+
+  printf ("%d-character strings, %s\n", BENCH_TEXT_UNITS,
+#ifdef TAG_X86_SIMD
+    __builtin_cpu_supports ("avx2") ? "AVX2" : "SSE2"
+#else
+    "no SIMD"
+#endif
+    );
+  bench_utf16 ("ASCII", ascii, sizeof (ascii) / sizeof (ascii[0]));
+  bench_utf16 ("Latin", latin, sizeof (latin) / sizeof (latin[0]));
+  bench_utf16 ("CJK", cjk, sizeof (cjk) / sizeof (cjk[0]));
+  bench_utf16 ("surrogates", emoji, sizeof (emoji) / sizeof (emoji[0]));
+  bench_latin1 ("ASCII", "The Wall");
+  bench_latin1 ("accented", "M\xFCnchen ");
+  bench_utf8_check ("ASCII", "The Wall");
+  bench_utf8_check ("accented", "M\xC3\xBCnchen ");
+  return 0;
+  }
@@ -0,0 +1,502 @@
+/*==========================================================================
+gettags
+check.c
+Copyright (c)2012-2024 Kevin Boone
+Distributed under the terms of the GNU Public Licence, v3.0
+==========================================================================*/
+
+/*
+ * Checks of the parts of gettags whose mistakes are hard to see from the
+ * command line: that a serialized TagData reads back as it was, and that
+ * tag_view() turns away blocks that are truncated or corrupt; that a
+ * Batch writes its output in the order that the files were added; and
+ * that the server frames its replies properly, and answers connections
+ * at once. Run with "make check". Each check prints a line, and the exit
+ * status is the number that failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "types.h"
+#include "tag_reader.h"
+#include "batch.h"
+#include "serve.h"
+
+// Longer than the longest request the server will take
+#define CHECK_LONG_REQUEST 20000
+
+#define CHECK_BATCH_FILES 500
+
+static int check_failures = 0;
+
+/*
+ * Note a failure, if cond is FALSE, and return cond
+ */
+#define CHECK(cond) check_that ((cond), #cond, __LINE__)
+
+static BOOL check_that (BOOL cond, const char *text, int line)
+  {
+  if (!cond)
+    {
+    printf ("  failed at line %d: %s\n", line, text);
+    check_failures++;
+    }
+  return cond;
+  }
+
+static void check_report (const char *name, int failures_before)
+  {
+  printf ("%-40s %s\n", name,
+    check_failures == failures_before ? "ok" : "FAILED");
+  }
+
+static void check_put_32_lsb (BYTE *p, unsigned int n)
+  {
+  p[0] = n & 0xFF;
+  p[1] = (n >> 8) & 0xFF;
+  p[2] = (n >> 16) & 0xFF;
+  p[3] = n >> 24;
+  }
+
+/*
+ * Make a FLAC file, in memory, with a Vorbis comment block of the
+ * specified comments, and nothing else. Returns its length.
+ */
+static size_t check_make_flac (BYTE *buff, const char **comments, int n)
+  {
+  static const char vendor[] = "check";
+  BYTE *p = buff + 8;
+  check_put_32_lsb (p, sizeof (vendor) - 1);
+  memcpy (p + 4, vendor, sizeof (vendor) - 1);
+  p += 4 + sizeof (vendor) - 1;
+  check_put_32_lsb (p, n);
+  p += 4;
+  int i;
+  for (i = 0; i < n; i++)
+    {
+    size_t len = strlen (comments[i]);
+    check_put_32_lsb (p, len);
+    memcpy (p + 4, comments[i], len);
+    p += 4 + len;
+    }
+
+  size_t block_len = p - buff - 8;
+  memcpy (buff, "fLaC", 4);
+  buff[4] = 0x80 | 4; // The last block, and a VORBIS_COMMENT
+  buff[5] = (block_len >> 16) & 0xFF;
+  buff[6] = (block_len >> 8) & 0xFF;
+  buff[7] = block_len & 0xFF;
+  return p - buff;
+  }
+
+/*
+ * Whether every string in a block that tag_view() has accepted is within
+ * the block, and the common tags are where they say
+ */
+static BOOL check_blob_sound (const TagBlob *blob)
+  {
+  const char *end = (const char *)blob + blob->size;
+  uint32_t i;
+  for (i = 0; i < blob->tag_count; i++)
+    {
+    const TagBlobTag *t = tag_blob_tag (blob, i);
+    if (!t) return FALSE;
+    const char *id = tag_blob_string (blob, t->id);
+    const char *data = tag_blob_string (blob, t->data);
+    if (!id || !data) return FALSE;
+    if (id >= end || memchr (id, 0, end - id) == NULL) return FALSE;
+    if (data + t->data_len >= end || data[t->data_len] != 0) return FALSE;
+    }
+  int c;
+  for (c = 0; c < TAG_COMMON_COUNT; c++)
+    {
+    const char *s = tag_blob_common (blob, c);
+    if (s && (s < (const char *)blob || s >= end)) return FALSE;
+    }
+  return tag_blob_tag (blob, blob->tag_count) == NULL;
+  }
+
+/*
+ * Serialize the tags of a file, and check that the block has the same
+ * tags, that no part of the block is enough, and that no change to any
+ * byte of the block lets a string run off its end
+ */
+static void check_serialize (void)
+  {
+  int before = check_failures;
+  static const char *comments[] =
+    {
+    "TITLE=Wish You Were Here",
+    "ARTIST=Pink Floyd",
+    "ALBUM=M\xC3\xBCnchen \xE6\x9D\xB1\xE4\xBA\xAC \xF0\x9F\x8E\xB5",
+    "DATE=1975",
+    "CUSTOM=",
+    "custom2=Another value",
+    };
+  int n_comments = sizeof (comments) / sizeof (comments[0]);
+  static BYTE flac[1024];
+  size_t flac_len = check_make_flac (flac, comments, n_comments);
+
+  TagData *tag_data = NULL;
+  if (!CHECK (tag_get_tags_from_buffer (flac, flac_len, &tag_data)
+      == TAG_OK))
+    {
+    check_report ("serialize: round trip", before);
+    return;
+    }
+  CHECK (tag_data->tag_count == n_comments);
+
+  void *blob = NULL;
+  size_t len = 0;
+  CHECK (tag_serialize (tag_data, &blob, &len) == TAG_OK);
+  const TagBlob *view = blob ? tag_view (blob, len) : NULL;
+  if (CHECK (view != NULL))
+    {
+    CHECK (view->size == len);
+    CHECK ((int)view->tag_count == tag_data->tag_count);
+    CHECK (check_blob_sound (view));
+    int i;
+    for (i = 0; i < tag_data->tag_count && i < (int)view->tag_count; i++)
+      {
+      const Tag *t = &tag_data->tags[i];
+      const TagBlobTag *b = tag_blob_tag (view, i);
+      CHECK (strcmp (tag_blob_string (view, b->id), t->frameId) == 0);
+      CHECK (strcmp (tag_blob_string (view, b->data),
+        (const char *)tag_get_text (t)) == 0);
+      CHECK ((int)b->data_len == t->data_len);
+      CHECK (b->key == t->key);
+      }
+    int c;
+    for (c = 0; c < TAG_COMMON_COUNT; c++)
+      {
+      const char *a = (const char *)tag_get_common (tag_data, c);
+      const char *b = tag_blob_common (view, c);
+      CHECK ((a == NULL) == (b == NULL));
+      if (a && b) CHECK (strcmp (a, b) == 0);
+      }
+    CHECK (strcmp (tag_blob_common (view, TAG_COMMON_ARTIST),
+      "Pink Floyd") == 0);
+    }
+  check_report ("serialize: round trip", before);
+
+  // Copies are made to just the right size, so that anything that reads
+  //  past the end can be caught by a memory checker
+  before = check_failures;
+  size_t part;
+  for (part = 0; blob && part < len; part++)
+    {
+    void *copy = malloc (part ? part : 1);
+    memcpy (copy, blob, part);
+    CHECK (tag_view (copy, part) == NULL);
+    free (copy);
+    }
+  check_report ("serialize: truncated blocks", before);
+
+  before = check_failures;
+  size_t at;
+  for (at = 0; blob && at < len; at++)
+    {
+    static const BYTE changes[] = { 0x01, 0x04, 0x10, 0x80, 0xFF };
+    int c;
+    for (c = 0; c < (int)sizeof (changes); c++)
+      {
+      BYTE *copy = malloc (len);
+      memcpy (copy, blob, len);
+      copy[at] ^= changes[c];
+      const TagBlob *v = tag_view (copy, len);
+      if (v && !CHECK (check_blob_sound (v)))
+        printf ("  byte %lu ^ 0x%02X\n", (unsigned long)at, changes[c]);
+      free (copy);
+      }
+    }
+  check_report ("serialize: corrupt blocks", before);
+
+  free (blob);
+  tag_free_tag_data (tag_data);
+  }
+
+/*
+ * For the batch, a file is a number, and its output is a line to out, 
+ * and for every third file, a line to err as well. The workers are held up for longer on the
+ * earlier files, so they finish out of order.
+ */
+static void check_batch_func (const char *file, FILE *out, FILE *err,
+    void *data, void *worker_data)
+  {
+  (void)data; (void)worker_data;
+  if (!out)
+    {
+    fprintf (err, "no memory for %s\n", file ? file : "?");
+    return;
+    }
+  int n = atoi (file);
+  if (n < 20) usleep ((20 - n) * 1000);
+  fprintf (out, "out %s\n", file);
+  if (n % 3 == 0) fprintf (err, "err %s\n", file);
+  }
+
+/*
+ * Run many files through a Batch, with its stdout and stderr both going
+ * to the same file, and check that each file's lines come together, and
+ * in order
+ */
+static void check_batch (void)
+  {
+  int before = check_failures;
+  FILE *f = tmpfile ();
+  if (!CHECK (f != NULL))
+    {
+    check_report ("batch: output in order", before);
+    return;
+    }
+
+  fflush (stdout);
+  fflush (stderr);
+  int saved_out = dup (STDOUT_FILENO), saved_err = dup (STDERR_FILENO);
+  dup2 (fileno (f), STDOUT_FILENO);
+  dup2 (fileno (f), STDERR_FILENO);
+
+  Batch *batch = batch_new (4, check_batch_func, NULL, NULL, NULL);
+  int i;
+  if (batch)
+    {
+    for (i = 0; i < CHECK_BATCH_FILES; i++)
+      {
+      char file[20];
+      sprintf (file, "%d", i);
+      batch_add (batch, file);
+      }
+    batch_finish (batch);
+    }
+
+  fflush (stdout);
+  dup2 (saved_out, STDOUT_FILENO);
+  dup2 (saved_err, STDERR_FILENO);
+  close (saved_out);
+  close (saved_err);
+
+  if (CHECK (batch != NULL))
+    {
+    char expected[100], line[100];
+    rewind (f);
+    BOOL in_order = TRUE;
+    for (i = 0; i < CHECK_BATCH_FILES && in_order; i++)
+      {
+      sprintf (expected, "out %d\n", i);
+      in_order = fgets (line, sizeof (line), f)
+        && strcmp (line, expected) == 0;
+      if (in_order && i % 3 == 0)
+        {
+        sprintf (expected, "err %d\n", i);
+        in_order = fgets (line, sizeof (line), f)
+          && strcmp (line, expected) == 0;
+        }
+      }
+    if (!CHECK (in_order)) printf ("  expected %s", expected);
+    CHECK (fgets (line, sizeof (line), f) == NULL);
+    }
+  fclose (f);
+  check_report ("batch: output in order", before);
+  }
+
+#ifndef _WIN32
+
+/*
+ * The server's requests are "echo text", which gives text and a line
+ * ending; "fail text", which gives the same as an error; "lines n",
+ * which gives n numbered lines; and "empty", which gives nothing
+ */
+static BOOL check_serve_func (char *request, FILE *out, void *data,
+    void *worker_data)
+  {
+  (void)data; (void)worker_data;
+  if (strncmp (request, "echo ", 5) == 0)
+    fprintf (out, "%s\n", request + 5);
+  else if (strncmp (request, "fail ", 5) == 0)
+    {
+    fprintf (out, "%s\n", request + 5);
+    return FALSE;
+    }
+  else if (strncmp (request, "lines ", 6) == 0)
+    {
+    int i, n = atoi (request + 6);
+    for (i = 0; i < n; i++) fprintf (out, "line %d\n", i);
+    }
+  else if (strcmp (request, "empty") != 0)
+    return FALSE;
+  return TRUE;
+  }
+
+static void *check_serve_thread (void *arg)
+  {
+  serve_socket ((const char *)arg, 2, check_serve_func, NULL, NULL, NULL);
+  return NULL;
+  }
+
+static int check_connect (const char *path)
+  {
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+  int tries;
+  for (tries = 0; tries < 500; tries++)
+    {
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0)
+      return fd;
+    close (fd);
+    usleep (10000);
+    }
+  return -1;
+  }
+
+/*
+ * Read exactly len bytes, giving up if nothing comes for five seconds,
+ * rather than hang if the server doesn't answer
+ */
+static BOOL check_read (int fd, char *buff, size_t len)
+  {
+  while (len > 0)
+    {
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll (&p, 1, 5000) != 1) return FALSE;
+    ssize_t n = read (fd, buff, len);
+    if (n <= 0) return FALSE;
+    buff += n;
+    len -= n;
+    }
+  return TRUE;
+  }
+
+/*
+ * Read a reply, and check that it is as expected
+ */
+static BOOL check_reply (int fd, BOOL ok, const char *body)
+  {
+  char header[40];
+  int i = 0;
+  while (i < (int)sizeof (header) - 1 && check_read (fd, header + i, 1)
+      && header[i] != '\n')
+    i++;
+  header[i] = 0;
+  char expected[40];
+  sprintf (expected, "%s %lu", ok ? "OK" : "ERROR",
+    (unsigned long)strlen (body));
+  if (strcmp (header, expected) != 0)
+    {
+    printf ("  reply '%s', not '%s'\n", header, expected);
+    return FALSE;
+    }
+  char *got = malloc (strlen (body) + 1);
+  BOOL same = got && check_read (fd, got, strlen (body))
+    && memcmp (got, body, strlen (body)) == 0;
+  free (got);
+  return same;
+  }
+
+static BOOL check_write (int fd, const char *s)
+  {
+  size_t len = strlen (s);
+  while (len > 0)
+    {
+    ssize_t n = write (fd, s, len);
+    if (n <= 0) return FALSE;
+    s += n;
+    len -= n;
+    }
+  return TRUE;
+  }
+
+/*
+ * Start a server on a socket, send it requests without waiting for the
+ * replies, and check that they come back whole and in order, and that
+ * an idle connection doesn't keep another waiting
+ */
+static void check_serve (void)
+  {
+  int before = check_failures;
+  static char path[100];
+  sprintf (path, "/tmp/gettags_check.%d.sock", (int)getpid ());
+  signal (SIGPIPE, SIG_IGN);
+
+  pthread_t thread;
+  if (!CHECK (pthread_create (&thread, NULL, check_serve_thread, path) 
+      == 0))
+    {
+    check_report ("serve: replies framed and in order", before);
+    return;
+    }
+  pthread_detach (thread);
+
+  int fd = check_connect (path);
+  if (CHECK (fd >= 0))
+    {
+    // A long body, and a request too long to take, among the others
+    char *lines = NULL;
+    size_t lines_len = 0;
+    FILE *f = open_memstream (&lines, &lines_len);
+    int i;
+    for (i = 0; i < 3000; i++) fprintf (f, "line %d\n", i);
+    fclose (f);
+    char *too_long = malloc (CHECK_LONG_REQUEST + 2);
+    memset (too_long, 'x', CHECK_LONG_REQUEST);
+    strcpy (too_long + CHECK_LONG_REQUEST, "\n");
+
+    CHECK (check_write (fd, "echo first\n\nfail no such file\r\n"));
+    CHECK (check_write (fd, "lines 3000\nempty\n"));
+    CHECK (check_write (fd, too_long));
+    CHECK (check_write (fd, "bogus\necho last"));
+    shutdown (fd, SHUT_WR);
+
+    CHECK (check_reply (fd, TRUE, "first\n"));
+    CHECK (check_reply (fd, FALSE, "no such file\n"));
+    CHECK (check_reply (fd, TRUE, lines));
+    CHECK (check_reply (fd, TRUE, ""));
+    CHECK (check_reply (fd, FALSE, "Request is too long\n"));
+    CHECK (check_reply (fd, FALSE, ""));
+    CHECK (check_reply (fd, TRUE, "last\n"));
+    char c;
+    CHECK (read (fd, &c, 1) == 0);
+    close (fd);
+    free (lines);
+    free (too_long);
+    }
+  check_report ("serve: replies framed and in order", before);
+
+  before = check_failures;
+  int idle = check_connect (path);
+  int busy = check_connect (path);
+  if (CHECK (idle >= 0 && busy >= 0))
+    {
+    CHECK (check_write (busy, "echo busy\n"));
+    CHECK (check_reply (busy, TRUE, "busy\n"));
+    CHECK (check_write (idle, "echo idle\n"));
+    CHECK (check_reply (idle, TRUE, "idle\n"));
+    }
+  if (idle >= 0) close (idle);
+  if (busy >= 0) close (busy);
+  check_report ("serve: connections answered at once", before);
+  unlink (path);
+  }
+
+#endif
+
+int main (void)
+  {
+  check_serialize ();
+  check_batch ();
+#ifndef _WIN32
+  check_serve ();
+#endif
+  printf ("%d failed\n", check_failures);
+  return check_failures;
+  }
@@ -1,2 +1,5 @@
-main.o: main.c tag_reader.h types.h
+main.o: main.c tag_reader.h types.h batch.h walk.h serve.h
 tag_reader.o: tag_reader.c tag_reader.h types.h
+batch.o: batch.c batch.h types.h
+walk.o: walk.c walk.h types.h
+serve.o: serve.c serve.h types.h
@@ -14,6 +14,13 @@ Distributed under the terms of the GNU Public Licence, v3.0
 #include <unistd.h>
 #include "types.h"
 #include "tag_reader.h"
+#include "batch.h"
+#include "walk.h"
+#include "serve.h"
+
+// More threads than this is surely a mistake, and each costs memory for
+//  the files it has waiting to be written
+#define MAX_JOBS 1024
 
 /**
 print_short_usage
@@ -21,7 +28,8 @@ Prints a short usage message
 */
 void print_short_usage(const char *argv0)
   {
-  printf ("Usage: %s -[vhds] [-c name] [-e name] {files...}\n", argv0);
+  printf ("Usage: %s -[vhds0] [-c name,...] [-e name] [-j jobs] [-r dir] "
+    "[-T list] {files...}\n", argv0);
   printf ("\"%s --longhelp\" for full details\n", argv0);
   }
 
@@ -34,15 +42,27 @@ void print_long_usage(const char *argv0)
   {
   printf ("Usage: %s [options]\n", argv0);
   printf ("-c, --common-name [name] show tag matching only this common name\n");
+  printf ("-c name,name,...         show these tags, on one line for each file\n");
   printf ("-C, --common-only        show only common tags\n");
   printf ("-c help                  lists common names\n");
   printf ("-d, --debug              show debugging data\n");
   printf ("-e, --exact-name [name]  show tag matching only this exact name\n");
+  printf ("-e name -e name ...      show these tags, on one line for each file\n");
+  printf ("--ext [ext,...]          with -r, files with these extensions\n");
   printf ("--longhelp               show detailed usage\n");
   printf ("-h, --help               show brief usage\n");
+  printf ("-j, --jobs [n]           read n files at once, 0 for one per CPU\n");
+  printf ("--magic                  with -r, files that look like audio\n");
+  printf ("--mmap                   map files into memory to read them\n");
   printf ("-o, --cover_filename     extract cover image\n");
+  printf ("-r, --recursive [dir]    read audio files in a directory tree\n");
   printf ("-s, --script             script mode\n");
+  printf ("--serve[=socket]         answer requests on stdin, or a socket\n");
+  printf ("--stats                  report file operations on exit\n");
+  printf ("-T, --files-from [file]  read files named in file (- for stdin)\n");
+  printf ("--utf8 [mode]            check UTF-8 text: check, replace, latin1\n");
   printf ("-v, --version            show version\n");
+  printf ("-0, --null               -T names end with NUL, not newline\n");
   }
 
 
@@ -50,15 +70,19 @@ void print_long_usage(const char *argv0)
 show_tag
 prints a tag if its type is text
 */
-void show_tag (const Tag *tag)
+void show_tag (FILE *out, const Tag *tag)
   {
-  printf ("%s", tag->frameId);
-  printf (" ");
+  fprintf (out, "%s", tag->frameId);
+  fprintf (out, " ");
   if (tag->type == TAG_TYPE_TEXT)
-    printf ("%s", (char*)tag->data);
+    {
+    int len;
+    const unsigned char *value = tag_get_value (tag, &len);
+    fwrite (value, 1, len, out);
+    }
   else
-    printf ("(binary)");
-  printf ("\n");
+    fprintf (out, "(binary)");
+  fprintf (out, "\n");
   }
 
 
@@ -94,9 +118,9 @@ const char *get_ext_from_mime (const char *mime)
  * type of the cover image.
  */
 void extract_cover (const char *argv0, const TagData *tag_data, 
-    const char *cover_filename, BOOL script)
+    const char *cover_filename, BOOL script, FILE *out)
   {
-  if (tag_data->cover)
+  if (tag_data->cover_len > 0)
     {
     if (tag_data->cover_mime[0])
       {
@@ -104,58 +128,218 @@ void extract_cover (const char *argv0, const TagData *tag_data,
       const char *ext = get_ext_from_mime (tag_data->cover_mime);
       snprintf (full_filename, sizeof (full_filename),
          "%s.%s", cover_filename, ext);
-      int f = open (full_filename, O_WRONLY | O_TRUNC | O_CREAT, 0xFFFF);
-      if (f > 0)
+      int f = open (full_filename, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+      if (f >= 0)
         {
-        write (f, tag_data->cover, tag_data->cover_len);
-        close (f);
+        TagResult r = tag_copy_cover_to_fd (tag_data, f);
+        int saved_errno = errno;
+        if (close (f) != 0 && r == TAG_OK) 
+          {
+          r = TAG_WRITEERROR;
+          saved_errno = errno;
+          }
+        if (r == TAG_WRITEERROR)
+          fprintf (out, "%s%s: can't write cover image: %s (%s)\n", 
+            make_prefix (FALSE, script), argv0, full_filename, 
+            strerror (saved_errno));
+        else if (r != TAG_OK)
+          fprintf (out, "%s%s: can't read cover image from file\n", 
+            make_prefix (FALSE, script), argv0);
         }
       else
         {
-        printf ("%s%s: can't open file for writing: %s (%s)\n", 
+        fprintf (out, "%s%s: can't open file for writing: %s (%s)\n", 
           make_prefix (FALSE, script), argv0, cover_filename, strerror (errno));
         }
       }
     else
       {
-      printf ("%s%s: cover image found, but file type is unknown\n", 
+      fprintf (out, "%s%s: cover image found, but file type is unknown\n", 
         make_prefix (FALSE, script), argv0);
       }
     }
   else 
-    printf ("%s%s: no cover image found\n", 
+    fprintf (out, "%s%s: no cover image found\n", 
       make_prefix (FALSE, script), argv0);
   }
 
 
+/**
+Field
+A tag that is asked for by name: a common name, in which case common_id 
+is not TAG_COMMON_NONE, or an exact name
+*/
+typedef struct
+  {
+  const char *name;
+  TagCommonID common_id;
+  } Field;
+
+
+/**
+FieldList
+The tags asked for with -c and -e, or in a --serve request, and a 
+filter that selects just those tags. The caller provides the arrays, 
+each with room for all the fields.
+*/
+typedef struct
+  {
+  Field *fields;
+  int n_fields;
+  const char **ids; // The exact names, for the filter
+  TagFilter filter;
+  } FieldList;
+
+
+void field_list_init (FieldList *list, Field *fields, const char **ids)
+  {
+  memset (list, 0, sizeof (FieldList));
+  list->fields = fields;
+  list->ids = ids;
+  list->filter.ids = ids;
+  }
+
+
+void field_list_add (FieldList *list, const char *name, 
+    TagCommonID common_id)
+  {
+  list->fields[list->n_fields].name = name;
+  list->fields[list->n_fields].common_id = common_id;
+  list->n_fields++;
+  if (common_id == TAG_COMMON_NONE)
+    list->ids[list->filter.n_ids++] = name;
+  else
+    list->filter.common |= TAG_COMMON_BIT (common_id);
+  }
+
+
+/**
+field_value
+Returns the text of the tag that a field asks for, or NULL if the file
+has no such tag
+*/
+const unsigned char *field_value (const TagData *tag_data, 
+    const Field *field)
+  {
+  if (field->common_id == TAG_COMMON_NONE)
+    return tag_get_by_id (tag_data, field->name);
+  return tag_get_common (tag_data, field->common_id);
+  }
+
+
+/**
+write_escaped
+Writes text with backslashes, tabs, and line endings escaped, so that it
+fits in one field of a line of tab-separated fields
+*/
+void write_escaped (FILE *out, const char *s)
+  {
+  for (; *s; s++)
+    {
+    switch (*s)
+      {
+      case '\\': fputs ("\\\\", out); break;
+      case '\t': fputs ("\\t", out); break;
+      case '\n': fputs ("\\n", out); break;
+      case '\r': fputs ("\\r", out); break;
+      default: fputc (*s, out);
+      }
+    }
+  }
+
+
+/**
+show_fields
+Prints the tags asked for by more than one -c or -e name, on one line: 
+the file name, then the value of each tag in turn, or \N if the file 
+doesn't have it, separated by tabs
+*/
+void show_fields (FILE *out, const char *filename, const TagData *tag_data,
+    const FieldList *list, BOOL script)
+  {
+  fputs (make_prefix (TRUE, script), out);
+  write_escaped (out, filename);
+  int i;
+  for (i = 0; i < list->n_fields; i++)
+    {
+    const unsigned char *s = field_value (tag_data, &list->fields[i]);
+    fputc ('\t', out);
+    if (s)
+      write_escaped (out, (const char *)s);
+    else
+      fputs ("\\N", out);
+    }
+  fputc ('\n', out);
+  }
+
+
+/**
+get_tags
+Reads the tags from a file.
+If filter is not NULL, only the tags it selects need be read, although 
+other tags may be returned as well. Tags read from files are allocated 
+from ctx, and are only valid until the next file is read
+*/
+TagResult get_tags (const char *filename, BOOL use_mmap, 
+    const TagFilter *filter, TagContext *ctx, TagData **tag_data_ret)
+  {
+  if (use_mmap)
+    return tag_get_tags_mmap (filename, tag_data_ret);
+  return tag_ctx_get_tags (ctx, filename, filter, tag_data_ret);
+  }
+
+
 /**
 do_file
-Process a file, according to the specified command-line arguments
+Process a file, according to the specified command-line arguments, 
+writing to out and err rather than stdout and stderr
 */
 void do_file (const char *argv0, const char *filename, BOOL script, 
-    TagCommonID common_id, const char *exact_name, BOOL common_only,
-      const char *cover_filename)
+    TagCommonID common_id, const char *exact_name, 
+      const FieldList *fields, BOOL common_only,
+      const char *cover_filename, BOOL use_mmap, TagContext *ctx,
+      FILE *out, FILE *err)
   {
+  // Work out which tags we need, so the rest can be skipped
+  TagFilter filter;
+  const TagFilter *p_filter = &filter;
+  memset (&filter, 0, sizeof (filter));
+  if (strlen (cover_filename) > 0)
+    filter.cover = TRUE;
+  else if (fields->n_fields > 1)
+    p_filter = &fields->filter;
+  else if (strlen (exact_name) > 0)
+    {
+    filter.ids = &exact_name;
+    filter.n_ids = 1;
+    }
+  else if (common_id != TAG_COMMON_NONE)
+    filter.common = TAG_COMMON_BIT (common_id);
+  else if (common_only)
+    filter.common = ~0u;
+  else
+    p_filter = NULL;
+
   TagData *tag_data = NULL; 
-  TagResult r = tag_get_tags (filename, &tag_data);
+  TagResult r = get_tags (filename, use_mmap, p_filter, ctx, &tag_data);
   switch (r)
     {
     case TAG_READERROR: 
-      fprintf (stderr, "%s%s: Can't read file '%s'\n", 
+      fprintf (err, "%s%s: Can't read file '%s'\n", 
         make_prefix(FALSE, script), argv0, filename);
       break;
     case TAG_TRUNCATED:
-      fprintf (stderr, "%s%s, Tag data is incomplete in '%s'\n", 
+      fprintf (err, "%s%s, Tag data is incomplete in '%s'\n", 
         make_prefix(FALSE, script), argv0, filename);
       break;
     case TAG_OUTOFMEMORY:
-      fprintf (stderr, "%s%s: Out of memory processing file '%s'\n", 
+      fprintf (err, "%s%s: Out of memory processing file '%s'\n", 
         make_prefix(FALSE, script), argv0, filename);
       break;
     case TAG_UNSUPFORMAT:
     case TAG_NOID3V2:
     case TAG_NOVORBIS:
-      fprintf (stderr, "%s%s: Unsupported tag format or no tags in file "
+      fprintf (err, "%s%s: Unsupported tag format or no tags in file "
        "'%s'\n", 
         make_prefix(FALSE, script), argv0, filename);
       break;
@@ -164,72 +348,75 @@ void do_file (const char *argv0, const char *filename, BOOL script,
       // Only if we get here should we proceed
       if (strlen (cover_filename) > 0)
         {
-        extract_cover (argv0, tag_data, cover_filename, script); 
+        extract_cover (argv0, tag_data, cover_filename, script, out); 
+        }
+      else if (fields->n_fields > 1)
+        {
+        show_fields (out, filename, tag_data, fields, script);
         }
       else if (strlen (exact_name) > 0)
         {
         const char *s = (char *)tag_get_by_id (tag_data, exact_name);
         if (s)
-          printf ("%s%s\n", make_prefix(TRUE, script), s);
+          fprintf (out, "%s%s\n", make_prefix(TRUE, script), s);
         else
-          printf ("%sTag not found\n", make_prefix(FALSE, script));
+          fprintf (out, "%sTag not found\n", make_prefix(FALSE, script));
         }
-      else if (common_id != -1)
+      else if (common_id != TAG_COMMON_NONE)
         {
         const unsigned char *s = tag_get_common 
           (tag_data, common_id);
         if (s)
-          printf ("%s%s\n", make_prefix(TRUE, script), s);
+          fprintf (out, "%s%s\n", make_prefix(TRUE, script), s);
         else
-          fprintf (stderr, "%sTag not found\n", make_prefix(FALSE, script));
+          fprintf (err, "%sTag not found\n", make_prefix(FALSE, script));
         }
       else
         {
-        if (script) printf ("OK\n");
+        if (script) fprintf (out, "OK\n");
         if (common_only)
           {
           const unsigned char *s = tag_get_common 
             (tag_data, TAG_COMMON_ALBUM);
-          if (s) printf ("%s %s\n", "album", s);
+          if (s) fprintf (out, "%s %s\n", "album", s);
           s = tag_get_common 
             (tag_data, TAG_COMMON_ARTIST);
-          if (s) printf ("%s %s\n", "artist", s);
+          if (s) fprintf (out, "%s %s\n", "artist", s);
           s = tag_get_common 
             (tag_data, TAG_COMMON_ALBUM_ARTIST);
-          if (s) printf ("%s %s\n", "album-artist", s);
+          if (s) fprintf (out, "%s %s\n", "album-artist", s);
           s = tag_get_common 
             (tag_data, TAG_COMMON_COMMENT);
-          if (s) printf ("%s %s\n", "comment", s);
+          if (s) fprintf (out, "%s %s\n", "comment", s);
           s = tag_get_common 
             (tag_data, TAG_COMMON_COMPOSER);
-          if (s) printf ("%s %s\n", "composer", s);
+          if (s) fprintf (out, "%s %s\n", "composer", s);
           s = tag_get_common 
             (tag_data, TAG_COMMON_DATE);
-          if (s) printf ("%s %s\n", "date", s);
+          if (s) fprintf (out, "%s %s\n", "date", s);
           s = tag_get_common 
             (tag_data, TAG_COMMON_GENRE);
-          if (s) printf ("%s %s\n", "genre", s);
+          if (s) fprintf (out, "%s %s\n", "genre", s);
           s = tag_get_common 
             (tag_data, TAG_COMMON_TITLE);
-          if (s) printf ("%s %s\n", "title", s);
+          if (s) fprintf (out, "%s %s\n", "title", s);
           s = tag_get_common 
             (tag_data, TAG_COMMON_TRACK);
-          if (s) printf ("%s %s\n", "track", s);
+          if (s) fprintf (out, "%s %s\n", "track", s);
           }
         else
           {
-          Tag *t = tag_data->tag;
-          while (t)
-            {
-            show_tag (t);
-            t = t->next;
-            }
+          TagIterator iter;
+          const Tag *t;
+          tag_iter_init (&iter, tag_data);
+          while ((t = tag_iter_next (&iter)))
+            show_tag (out, t);
           }
         }
       }
       break;
     default:
-      fprintf (stderr, "%s%s: Internal error processing file '%s'\n", 
+      fprintf (err, "%s%s: Internal error processing file '%s'\n", 
         make_prefix(FALSE, script), argv0, filename);
     }
   tag_free_tag_data (tag_data);
@@ -237,6 +424,157 @@ void do_file (const char *argv0, const char *filename, BOOL script,
 
 
 
+/**
+FileArgs
+The command-line arguments that do_file() needs, for do_file_in_batch()
+*/
+typedef struct
+  {
+  const char *argv0;
+  BOOL script;
+  TagCommonID common_id;
+  const char *exact_name;
+  const FieldList *fields;
+  BOOL common_only;
+  const char *cover_filename;
+  BOOL use_mmap;
+  } FileArgs;
+
+
+/**
+do_file_in_batch
+Process a file on one of a batch's worker threads, each of which has
+its own TagContext
+*/
+void do_file_in_batch (const char *filename, FILE *out, FILE *err, 
+    void *data, void *worker_data)
+  {
+  const FileArgs *args = data;
+  TagContext *ctx = worker_data;
+  if (!filename)
+    {
+    fprintf (err, "%s%s: Out of memory\n", 
+      make_prefix (FALSE, args->script), args->argv0);
+    return;
+    }
+  if (!out || !ctx)
+    {
+    fprintf (err, "%s%s: Out of memory processing file '%s'\n", 
+      make_prefix (FALSE, args->script), args->argv0, filename);
+    return;
+    }
+  do_file (args->argv0, filename, args->script, args->common_id, 
+    args->exact_name, args->fields, args->common_only, 
+    args->cover_filename, args->use_mmap, ctx, out, err);
+  }
+
+void *new_worker_ctx (void)
+  {
+  return tag_ctx_new ();
+  }
+
+void free_worker_ctx (void *ctx)
+  {
+  tag_ctx_free (ctx);
+  }
+
+
+/**
+FileRun
+Where main() sends each file: to a batch, if there is one, or straight
+to do_file() with the one TagContext
+*/
+typedef struct
+  {
+  FileArgs args;
+  Batch *batch;
+  TagContext *ctx;
+  int count;     // Files sent, for --stats
+  } FileRun;
+
+
+/**
+run_file
+Process a file, or add it to the batch to be processed
+*/
+void run_file (FileRun *run, const char *filename)
+  {
+  const FileArgs *args = &run->args;
+  run->count++;
+  if (run->batch)
+    batch_add (run->batch, filename);
+  else
+    do_file (args->argv0, filename, args->script, args->common_id, 
+      args->exact_name, args->fields, args->common_only, 
+      args->cover_filename, args->use_mmap, run->ctx, stdout, stderr);
+  }
+
+
+/**
+run_walk_file
+Called by walk_tree() for each file found by -r
+*/
+void run_walk_file (const char *path, int error, void *data)
+  {
+  FileRun *run = data;
+  if (error)
+    fprintf (stderr, "%s%s: Can't read directory '%s': %s\n", 
+      make_prefix (FALSE, run->args.script), run->args.argv0, path, 
+      strerror (error));
+  else
+    run_file (run, path);
+  }
+
+
+/**
+run_file_list
+Process the files named in a list, one to a line, or each followed by
+delim, as the names are read. Only one name is in memory at a time, so
+the list can be any length. Returns FALSE if the list can't be read.
+*/
+BOOL run_file_list (FileRun *run, const char *list, int delim)
+  {
+  FILE *f = strcmp (list, "-") == 0 ? stdin : fopen (list, "r");
+  if (!f) return FALSE;
+  char *name = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getdelim (&name, &size, delim, f)) > 0)
+    {
+    if (name[len - 1] == delim) name[--len] = 0;
+    if (len > 0) run_file (run, name);
+    }
+  BOOL ok = !ferror (f);
+  free (name);
+  if (f != stdin) fclose (f);
+  return ok;
+  }
+
+
+/**
+parse_ext_list
+Splits a comma-separated list of file extensions, for --ext. The list is
+changed in place. Returns the number of extensions, or -1 if we run out 
+of memory. 
+*/
+int parse_ext_list (char *list, const char ***exts_ret)
+  {
+  int n = 1;
+  char *p;
+  for (p = list; *p; p++)
+    if (*p == ',') n++;
+  const char **exts = malloc (n * sizeof (char *));
+  if (!exts) return -1;
+  n = 0;
+  char *saveptr = NULL;
+  for (p = strtok_r (list, ",", &saveptr); p; 
+      p = strtok_r (NULL, ",", &saveptr))
+    exts[n++] = (*p == '.') ? p + 1 : p;
+  *exts_ret = exts;
+  return n;
+  }
+
+
 /**
 common_name_to_common_id
 Maps human-readable tag names to constants defined in the header file
@@ -254,7 +592,100 @@ TagCommonID common_name_to_common_id (const char *common_name)
   if (strcmp (common_name, "title") == 0)  return TAG_COMMON_TITLE; 
   if (strcmp (common_name, "track") == 0) return TAG_COMMON_TRACK; 
   if (strcmp (common_name, "year") == 0)  return TAG_COMMON_YEAR; 
-  return -1;
+  return TAG_COMMON_NONE;
+  }
+
+
+#define SERVE_MAX_NAMES 64
+
+/**
+serve_request
+Answers a --serve request, "GET path names", where names is a list of 
+common names or exact tag names, separated by commas. For each name, in 
+the same order, the reply has a line with the name and the length of the
+tag's value, then the value and a line ending; or, if there is no such 
+tag, a line with the name and -. The file is read by the thread's 
+TagContext.
+*/
+BOOL serve_request (char *request, FILE *out, void *data, 
+    void *worker_data)
+  {
+  const FileArgs *args = data;
+  TagContext *ctx = worker_data;
+  if (!ctx)
+    {
+    fprintf (out, "Out of memory\n");
+    return FALSE;
+    }
+  if (strncmp (request, "GET ", 4) != 0)
+    {
+    fprintf (out, "Unknown request\n");
+    return FALSE;
+    }
+
+  // The path may have spaces in it, but the names can't
+  char *path = request + 4;
+  char *names = strrchr (path, ' ');
+  if (!names || names == path)
+    {
+    fprintf (out, "No tag names in request\n");
+    return FALSE;
+    }
+  *names++ = 0;
+
+  Field fields[SERVE_MAX_NAMES];
+  const char *ids[SERVE_MAX_NAMES];
+  FieldList list;
+  field_list_init (&list, fields, ids);
+  char *saveptr = NULL, *name;
+  for (name = strtok_r (names, ",", &saveptr); name; 
+      name = strtok_r (NULL, ",", &saveptr))
+    {
+    if (list.n_fields == SERVE_MAX_NAMES)
+      {
+      fprintf (out, "Too many tag names in request\n");
+      return FALSE;
+      }
+    field_list_add (&list, name, common_name_to_common_id (name));
+    }
+
+  TagData *tag_data = NULL;
+  TagResult r = args->use_mmap ? tag_get_tags_mmap (path, &tag_data)
+    : tag_ctx_get_tags (ctx, path, &list.filter, &tag_data);
+  int i;
+  switch (r)
+    {
+    case TAG_OK:
+      for (i = 0; i < list.n_fields; i++)
+        {
+        const unsigned char *s = field_value (tag_data, &fields[i]);
+        if (s)
+          fprintf (out, "%s %lu\n%s\n", fields[i].name, 
+            (unsigned long)strlen ((const char *)s), s);
+        else
+          fprintf (out, "%s -\n", fields[i].name);
+        }
+      break;
+    case TAG_READERROR: 
+      fprintf (out, "Can't read file '%s'\n", path);
+      break;
+    case TAG_TRUNCATED:
+      fprintf (out, "Tag data is incomplete in '%s'\n", path);
+      break;
+    case TAG_OUTOFMEMORY:
+      fprintf (out, "Out of memory processing file '%s'\n", path);
+      break;
+    case TAG_UNSUPFORMAT:
+    case TAG_NOID3V2:
+    case TAG_NOVORBIS:
+      fprintf (out, "Unsupported tag format or no tags in file '%s'\n", 
+        path);
+      break;
+    default:
+      fprintf (out, "Internal error processing file '%s'\n", path);
+    }
+  tag_free_tag_data (tag_data);
+  return r == TAG_OK;
   }
 
 
@@ -269,8 +700,15 @@ int main (int argc, char **argv)
   static BOOL opt_debug = FALSE;
   static BOOL opt_script = FALSE;
   static BOOL opt_common_only = FALSE;
-  char opt_common_name[512];
-  char opt_exact_name[32];
+  static BOOL opt_stats = FALSE;
+  static BOOL opt_mmap = FALSE;
+  static BOOL opt_magic = FALSE;
+  static BOOL opt_null = FALSE;
+  static BOOL opt_serve = FALSE;
+  const char *opt_socket = NULL;
+  int opt_jobs = 1;
+  char *opt_ext = NULL;
+  const char *opt_files_from = NULL;
   char opt_cover_filename[512];
 
   static struct option long_options[] = 
@@ -284,17 +722,38 @@ int main (int argc, char **argv)
     {"common-only", no_argument, NULL, 'C'},
     {"exact-name", required_argument, NULL, 'e'},
     {"cover-filename", required_argument, NULL, 'o'},
+    {"stats", no_argument, NULL, 0},
+    {"mmap", no_argument, NULL, 0},
+    {"utf8", required_argument, NULL, 0},
+    {"jobs", required_argument, NULL, 'j'},
+    {"recursive", required_argument, NULL, 'r'},
+    {"ext", required_argument, NULL, 0},
+    {"magic", no_argument, NULL, 0},
+    {"files-from", required_argument, NULL, 'T'},
+    {"null", no_argument, NULL, '0'},
+    {"serve", optional_argument, NULL, 0},
     {0, 0, 0, 0},
     };
 
-  opt_common_name[0] = 0;
-  opt_exact_name[0] = 0;
   opt_cover_filename[0] = 0;
 
+  // Directories for -r, and the names from -c and -e, in the order they
+  //  are given; there can't be more of them than there are arguments
+  const char **opt_dirs = malloc (argc * sizeof (char *));
+  int n_dirs = 0;
+  char **opt_names = malloc (argc * sizeof (char *));
+  BOOL *opt_names_common = malloc (argc * sizeof (BOOL));
+  int n_names = 0;
+  if (!opt_dirs || !opt_names || !opt_names_common)
+    {
+    fprintf (stderr, "%s: Out of memory\n", argv[0]);
+    return -1;
+    }
+
   while (1)
     {
     int option_index = 0;
-    int opt = getopt_long (argc, argv, "?vhdc:Ce:so:", long_options, 
+    int opt = getopt_long (argc, argv, "?vhdc:Ce:so:j:r:T:0", long_options, 
       &option_index);
     if (opt == -1) break;
     switch (opt)
@@ -319,12 +778,14 @@ int main (int argc, char **argv)
           }
         else if (strcmp (long_options[option_index].name, "common-name") == 0)
           {
-          strncpy (opt_common_name, optarg, sizeof (opt_common_name));
+          opt_names_common[n_names] = TRUE;
+          opt_names[n_names++] = optarg;
           }
         else if (strcmp (long_options[option_index].name, 
              "cover-filename") == 0)
           {
-          strncpy (opt_common_name, optarg, sizeof (opt_cover_filename));
+          snprintf (opt_cover_filename, sizeof (opt_cover_filename), "%s", 
+            optarg);
           }
         else if (strcmp (long_options[option_index].name, "common-only") == 0)
           {
@@ -332,7 +793,44 @@ int main (int argc, char **argv)
           }
         else if (strcmp (long_options[option_index].name, "exact-name") == 0)
           {
-          strncpy (opt_exact_name, optarg, sizeof (opt_exact_name));
+          opt_names_common[n_names] = FALSE;
+          opt_names[n_names++] = optarg;
+          }
+        else if (strcmp (long_options[option_index].name, "stats") == 0)
+          {
+          opt_stats = TRUE;
+          }
+        else if (strcmp (long_options[option_index].name, "mmap") == 0)
+          {
+          opt_mmap = TRUE;
+          }
+        else if (strcmp (long_options[option_index].name, "magic") == 0)
+          {
+          opt_magic = TRUE;
+          }
+        else if (strcmp (long_options[option_index].name, "ext") == 0)
+          {
+          opt_ext = optarg;
+          }
+        else if (strcmp (long_options[option_index].name, "serve") == 0)
+          {
+          opt_serve = TRUE;
+          opt_socket = optarg;
+          }
+        else if (strcmp (long_options[option_index].name, "utf8") == 0)
+          {
+          if (strcmp (optarg, "check") == 0)
+            tag_utf8_repair = TAG_UTF8_CHECK;
+          else if (strcmp (optarg, "replace") == 0)
+            tag_utf8_repair = TAG_UTF8_REPLACE;
+          else if (strcmp (optarg, "latin1") == 0)
+            tag_utf8_repair = TAG_UTF8_LATIN1;
+          else
+            {
+            fprintf (stderr, "%s: unknown UTF-8 mode '%s'\n", 
+              argv[0], optarg);
+            return -1;
+            }
           }
         } // End of long options
         break;
@@ -349,16 +847,42 @@ int main (int argc, char **argv)
         opt_help = TRUE;
         break;
       case 'c': 
-        strncpy (opt_common_name, optarg, sizeof (opt_common_name));
+        opt_names_common[n_names] = TRUE;
+        opt_names[n_names++] = optarg;
         break;
       case 'o': 
-        strncpy (opt_cover_filename, optarg, sizeof (opt_cover_filename));
+        snprintf (opt_cover_filename, sizeof (opt_cover_filename), "%s", 
+          optarg);
         break;
       case 'C': 
         opt_common_only = TRUE; 
         break;
       case 'e': 
-        strncpy (opt_exact_name, optarg, sizeof (opt_exact_name));
+        opt_names_common[n_names] = FALSE;
+        opt_names[n_names++] = optarg;
+        break;
+      case 'j': 
+        {
+        char *end;
+        long jobs = strtol (optarg, &end, 10);
+        if (end == optarg || *end || jobs < 0 || jobs > MAX_JOBS) jobs = -1;
+        else if (jobs == 0) jobs = sysconf (_SC_NPROCESSORS_ONLN);
+        opt_jobs = jobs;
+        if (opt_jobs < 1)
+          {
+          fprintf (stderr, "%s: bad number of jobs '%s'\n", argv[0], optarg);
+          return -1;
+          }
+        }
+        break;
+      case 'r': 
+        opt_dirs[n_dirs++] = optarg;
+        break;
+      case 'T': 
+        opt_files_from = optarg;
+        break;
+      case '0': 
+        opt_null = TRUE;
         break;
       }
     }
@@ -386,10 +910,33 @@ int main (int argc, char **argv)
   if (opt_debug)
     tag_debug = TRUE;
 
-  TagCommonID common_id = -1; 
-  if (strlen (opt_common_name) > 0)
+  // Each -c can have a list of names, separated by commas
+  int i, n_fields = 0;
+  char *p;
+  for (i = 0; i < n_names; i++)
+    {
+    n_fields++;
+    if (opt_names_common[i])
+      for (p = opt_names[i]; *p; p++)
+        if (*p == ',') n_fields++;
+    }
+  Field *fields = malloc ((n_fields + 1) * sizeof (Field));
+  const char **ids = malloc ((n_fields + 1) * sizeof (char *));
+  if (!fields || !ids)
     {
-    if (strcmp (opt_common_name, "help") == 0)
+    fprintf (stderr, "%s: Out of memory\n", argv[0]);
+    return -1;
+    }
+  FieldList field_list;
+  field_list_init (&field_list, fields, ids);
+  for (i = 0; i < n_names; i++)
+    {
+    if (!opt_names_common[i])
+      {
+      field_list_add (&field_list, opt_names[i], -1);
+      continue;
+      }
+    if (strcmp (opt_names[i], "help") == 0)
       {
       printf 
        ("%s: common names: album album-artist artist comment composer date"
@@ -397,37 +944,142 @@ int main (int argc, char **argv)
           argv[0]); 
       return 0;
       }
-    common_id = common_name_to_common_id (opt_common_name);    
-    if (common_id == -1)
+    char *saveptr = NULL, *name;
+    for (name = strtok_r (opt_names[i], ",", &saveptr); name; 
+        name = strtok_r (NULL, ",", &saveptr))
       {
-      fprintf (stderr, "%s: unknown common name '%s'\n", 
-        argv[0], opt_common_name);
-      fprintf (stderr, "'%s --common-name help' for a list\n", argv[0]);
-      return -1;
+      TagCommonID id = common_name_to_common_id (name);    
+      if (id == TAG_COMMON_NONE)
+        {
+        fprintf (stderr, "%s: unknown common name '%s'\n", 
+          argv[0], name);
+        fprintf (stderr, "'%s --common-name help' for a list\n", argv[0]);
+        return -1;
+        }
+      field_list_add (&field_list, name, id);
       }
     }
 
-  if (common_id != -1 && strlen (opt_exact_name) > 0)
+  // With just one name, the tag is shown on its own, as it always was;
+  //  with more, they are all shown on one line -- see show_fields()
+  TagCommonID common_id = TAG_COMMON_NONE; 
+  const char *exact_name = "";
+  if (field_list.n_fields == 1)
     {
-    fprintf (stderr, 
-      "'%s: ignoring common name because exact name was supplied\n", argv[0]);
+    common_id = fields[0].common_id;
+    if (common_id == TAG_COMMON_NONE) exact_name = fields[0].name;
+    }
+
+  static const char *audio_exts[] = 
+    { "mp3", "flac", "ogg", "oga", "opus", "m4a", "m4b", "mp4" };
+  WalkFilter walk_filter = { audio_exts, 
+    sizeof (audio_exts) / sizeof (audio_exts[0]), NULL, 0 };
+  const char **exts = NULL;
+  if (opt_magic)
+    {
+    walk_filter.n_exts = 0;
+    walk_filter.magic = tag_sniff;
+    walk_filter.magic_len = TAG_SNIFF_SIZE;
+    }
+  else if (opt_ext)
+    {
+    walk_filter.n_exts = parse_ext_list (opt_ext, &exts);
+    walk_filter.exts = exts;
+    if (walk_filter.n_exts < 0)
+      {
+      fprintf (stderr, "%s: Out of memory\n", argv[0]);
+      return -1;
+      }
     }
 
-  if (optind == argc)
+  FileRun run = { { argv[0], opt_script, common_id, exact_name, 
+    &field_list, opt_common_only, opt_cover_filename, opt_mmap }, 
+    NULL, NULL, 0 };
+  if (opt_serve)
+    {
+    // A request is answered with a TagContext that no other thread is 
+    //  using; on a socket, there are -j of them
+    if (opt_socket)
+      {
+      serve_socket (opt_socket, opt_jobs, serve_request, &run.args, 
+        new_worker_ctx, free_worker_ctx);
+      fprintf (stderr, "%s: Can't serve on '%s': %s\n", argv[0], 
+        opt_socket, strerror (errno));
+      return -1;
+      }
+    serve_stdio (serve_request, &run.args, new_worker_ctx, 
+      free_worker_ctx);
+    }
+  else if (optind == argc && n_dirs == 0 && !opt_files_from)
     {
     fprintf (stderr, 
       "%s%s: No files specified\n", make_prefix (FALSE, opt_script), argv[0]);
     }
-  else
+  else 
     {
-    int i;
+    if (opt_jobs > 1 && strlen (opt_cover_filename) > 0)
+      fprintf (stderr, "%s%s: -j is ignored with -o\n", 
+        make_prefix (FALSE, opt_script), argv[0]);
+    if (opt_jobs > 1 && strlen (opt_cover_filename) == 0)
+      {
+      // Cover images are all written to the same file, so only the last
+      //  file's would be kept, and it must be the last file that's done
+      run.batch = batch_new (opt_jobs, do_file_in_batch, &run.args, 
+        new_worker_ctx, free_worker_ctx);
+      if (!run.batch)
+        {
+        fprintf (stderr, "%s%s: Can't start worker threads\n", 
+          make_prefix (FALSE, opt_script), argv[0]);
+        return -1;
+        }
+      }
+    else
+      {
+      // All the files are read with the same context, so the memory used 
+      //  for one file is reused for the next
+      run.ctx = tag_ctx_new ();
+      if (!run.ctx)
+        {
+        fprintf (stderr, "%s%s: Out of memory\n", 
+          make_prefix (FALSE, opt_script), argv[0]);
+        return -1;
+        }
+      }
+
     for (i = optind; i < argc; i++)
+      run_file (&run, argv[i]);
+
+    if (opt_files_from && !run_file_list (&run, opt_files_from, 
+        opt_null ? 0 : '\n'))
       {
-      do_file (argv[0], argv[i], opt_script, common_id, 
-        opt_exact_name, opt_common_only, opt_cover_filename);
+      fprintf (stderr, "%s%s: Can't read file list '%s'\n", 
+        make_prefix (FALSE, opt_script), argv[0], opt_files_from);
       }
+
+    // With more than one job, the directories are read on threads of 
+    //  their own, as well as the files
+    for (i = 0; i < n_dirs; i++)
+      walk_tree (opt_dirs[i], opt_jobs > 1 ? opt_jobs : 0, &walk_filter,
+        run_walk_file, &run);
+
+    if (run.batch) batch_finish (run.batch);
+    if (run.ctx) tag_ctx_free (run.ctx);
+    }
+
+  if (opt_stats)
+    {
+    fprintf (stderr, "%s: %d file(s), %ld open(s), %ld read(s), "
+      "%ld seek(s), %ld byte(s) read\n", argv[0], run.count, 
+      tag_stats.opens, tag_stats.reads, tag_stats.seeks, 
+      tag_stats.bytes_read);
     }
 
+  free (exts);
+  free (fields);
+  free (ids);
+  free (opt_names);
+  free (opt_names_common);
+  free (opt_dirs);
   return 0;
   }
 
@@ -0,0 +1,368 @@
+/*==========================================================================
+gettags
+serve.c
+Copyright (c)2012-2024 Kevin Boone
+Distributed under the terms of the GNU Public Licence, v3.0
+==========================================================================*/
+
+/*
+ * Requests are read into a buffer with read(), rather than through
+ * stdio, so that we can tell when there are no more to answer for the
+ * time being. Only then are the replies flushed, so that a client that
+ * sends many requests at once gets many replies in one write, and one
+ * that waits for each reply doesn't wait for long.
+ *
+ * On a socket, each connection that is accepted gets a thread of its
+ * own, which answers requests on it until the client closes it, so one
+ * client can't keep the others waiting by keeping its connection open.
+ * What takes the time, though, is answering the requests, and that needs
+ * worker data -- a TagContext, for gettags -- of which there are only so
+ * many. A thread borrows worker data for each request that it answers,
+ * waiting for some if they are all in use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "types.h"
+#include "serve.h"
+
+#define SERVE_LINE_MAX 16384
+
+typedef struct _ServeConn
+  {
+  struct _Serve *serve;
+  int fd;
+  struct _ServeConn *prev;
+  struct _ServeConn *next;
+  } ServeConn;
+
+typedef struct _Serve
+  {
+  ServeFunc func;
+  void *data;
+  // For a socket. These are protected by lock
+  pthread_mutex_t lock;
+  pthread_cond_t returned; // Worker data has been put back
+  pthread_cond_t closed;   // A connection has ended
+  void **workers;          // Worker data that isn't being used, or NULL
+                           //  if there is just the one of serve_stdio()
+  int n_workers;
+  ServeConn *conns;        // Connections that are being answered
+  } Serve;
+
+static void serve_write (FILE *out, BOOL ok, const char *body, size_t len)
+  {
+  fprintf (out, "%s %lu\n", ok ? "OK" : "ERROR", (unsigned long)len);
+  fwrite (body, 1, len, out);
+  }
+
+#ifndef _WIN32
+
+/*
+ * Borrow worker data to answer a request with, waiting if all of it is
+ * in use
+ */
+static void *serve_take_worker (Serve *serve)
+  {
+  pthread_mutex_lock (&serve->lock);
+  while (serve->n_workers == 0)
+    pthread_cond_wait (&serve->returned, &serve->lock);
+  void *worker_data = serve->workers[--serve->n_workers];
+  pthread_mutex_unlock (&serve->lock);
+  return worker_data;
+  }
+
+static void serve_put_worker (Serve *serve, void *worker_data)
+  {
+  pthread_mutex_lock (&serve->lock);
+  serve->workers[serve->n_workers++] = worker_data;
+  pthread_cond_signal (&serve->returned);
+  pthread_mutex_unlock (&serve->lock);
+  }
+
+#endif
+
+/*
+ * Answer one request. The body of the reply has to be collected before
+ * any of it is written, because its length comes first.
+ */
+static void serve_reply (Serve *serve, char *request, FILE *out,
+    void *worker_data)
+  {
+  char *body = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream (&body, &len);
+  BOOL ok = FALSE;
+  if (f)
+    {
+#ifndef _WIN32
+    if (serve->workers) worker_data = serve_take_worker (serve);
+#endif
+    ok = serve->func (request, f, serve->data, worker_data);
+#ifndef _WIN32
+    if (serve->workers) serve_put_worker (serve, worker_data);
+#endif
+    }
+  if (f && fclose (f) == 0)
+    serve_write (out, ok, body, len);
+  else
+    serve_write (out, FALSE, "Out of memory\n", 14);
+  free (body);
+  }
+
+/*
+ * Answer the requests that arrive on in, until it ends, or out can't be
+ * written. worker_data is used for every request, unless the server
+ * has worker data to lend.
+ */
+static void serve_connection (Serve *serve, int in, FILE *out,
+    void *worker_data)
+  {
+  char *buff = malloc (SERVE_LINE_MAX + 1);
+  if (!buff) return;
+  size_t start = 0, end = 0;
+  BOOL skipping = FALSE; // Throwing away a request that is too long
+  BOOL more = TRUE;
+
+  while (more || start < end)
+    {
+    char *nl = memchr (buff + start, '\n', end - start);
+    if (nl || (!more && start < end))
+      {
+      // The last request needn't have a line ending
+      char *request = buff + start;
+      if (!nl) nl = buff + end;
+      *nl = 0;
+      start = nl - buff + 1;
+      if (start > end) start = end;
+      if (skipping)
+        {
+        skipping = FALSE;
+        continue;
+        }
+      size_t len = nl - request;
+      if (len > 0 && request[len - 1] == '\r') request[--len] = 0;
+      if (len > 0) serve_reply (serve, request, out, worker_data);
+      continue;
+      }
+    if (!more) break;
+
+    if (start == 0 && end == SERVE_LINE_MAX)
+      {
+      if (!skipping)
+        serve_write (out, FALSE, "Request is too long\n", 20);
+      skipping = TRUE;
+      end = 0;
+      }
+    memmove (buff, buff + start, end - start);
+    end -= start;
+    start = 0;
+
+    // There are no whole requests left, so send the replies before
+    //  waiting for more
+    if (fflush (out) != 0) break;
+    ssize_t n = read (in, buff + end, SERVE_LINE_MAX - end);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0)
+      more = FALSE;
+    else
+      end += n;
+    }
+
+  fflush (out);
+  free (buff);
+  }
+
+/*
+ * Answer requests from stdin -- see serve.h
+ */
+int serve_stdio (ServeFunc func, void *data,
+    void *(*worker_new) (void), void (*worker_free) (void *))
+  {
+  Serve serve;
+  memset (&serve, 0, sizeof (serve));
+  serve.func = func;
+  serve.data = data;
+  void *worker_data = worker_new ? worker_new () : NULL;
+  // If the client goes away, writing fails, rather than killing us
+  signal (SIGPIPE, SIG_IGN);
+  serve_connection (&serve, STDIN_FILENO, stdout, worker_data);
+  if (worker_free) worker_free (worker_data);
+  return 0;
+  }
+
+#ifndef _WIN32
+
+/*
+ * Answer the requests on one connection, and close it
+ */
+static void *serve_thread (void *arg)
+  {
+  ServeConn *conn = arg;
+  Serve *serve = conn->serve;
+  // Replies go through stdio
+  FILE *out = fdopen (conn->fd, "w");
+  if (out) serve_connection (serve, conn->fd, out, NULL);
+
+  pthread_mutex_lock (&serve->lock);
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    serve->conns = conn->next;
+  if (conn->next) conn->next->prev = conn->prev;
+  pthread_cond_signal (&serve->closed);
+  pthread_mutex_unlock (&serve->lock);
+
+  // serve_socket() may have returned by now, so serve mustn't be used
+  if (out)
+    fclose (out);
+  else
+    close (conn->fd);
+  free (conn);
+  return NULL;
+  }
+
+/*
+ * Start a thread to answer the requests on a connection
+ */
+static void serve_start (Serve *serve, int fd)
+  {
+  ServeConn *conn = malloc (sizeof (ServeConn));
+  if (!conn)
+    {
+    close (fd);
+    return;
+    }
+  conn->serve = serve;
+  conn->fd = fd;
+  conn->prev = NULL;
+  pthread_mutex_lock (&serve->lock);
+  conn->next = serve->conns;
+  if (serve->conns) serve->conns->prev = conn;
+  serve->conns = conn;
+  pthread_mutex_unlock (&serve->lock);
+
+  pthread_t thread;
+  if (pthread_create (&thread, NULL, serve_thread, conn) == 0)
+    {
+    pthread_detach (thread);
+    return;
+    }
+  // The thread would have done this
+  pthread_mutex_lock (&serve->lock);
+  serve->conns = conn->next;
+  if (conn->next) conn->next->prev = NULL;
+  pthread_mutex_unlock (&serve->lock);
+  close (fd);
+  free (conn);
+  }
+
+/*
+ * Answer requests on a Unix domain socket -- see serve.h
+ */
+int serve_socket (const char *path, int threads, ServeFunc func,
+    void *data, void *(*worker_new) (void), void (*worker_free) (void *))
+  {
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+    errno = ENAMETOOLONG;
+    return -1;
+    }
+  strcpy (addr.sun_path, path);
+
+  Serve serve;
+  memset (&serve, 0, sizeof (serve));
+  serve.func = func;
+  serve.data = data;
+  if (threads < 1) threads = 1;
+  serve.workers = calloc (threads, sizeof (void *));
+  if (!serve.workers) return -1;
+
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  struct stat sb;
+  if (fd >= 0 && lstat (path, &sb) == 0 && S_ISSOCK (sb.st_mode)) 
+    unlink (path);
+  if (fd < 0 || bind (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0
+      || listen (fd, SOMAXCONN) != 0)
+    {
+    int error = errno;
+    if (fd >= 0) close (fd);
+    free (serve.workers);
+    errno = error;
+    return -1;
+    }
+
+  for (serve.n_workers = 0; serve.n_workers < threads; serve.n_workers++)
+    serve.workers[serve.n_workers] = worker_new ? worker_new () : NULL;
+  pthread_mutex_init (&serve.lock, NULL);
+  pthread_cond_init (&serve.returned, NULL);
+  pthread_cond_init (&serve.closed, NULL);
+  signal (SIGPIPE, SIG_IGN);
+
+  int error;
+  while (1)
+    {
+    int c = accept (fd, NULL, NULL);
+    if (c >= 0)
+      {
+      serve_start (&serve, c);
+      continue;
+      }
+    error = errno;
+    if (error == EINTR || error == ECONNABORTED) continue;
+    // Out of descriptors, but they'll come back when a client goes
+    pthread_mutex_lock (&serve.lock);
+    BOOL wait = (error == EMFILE || error == ENFILE) && serve.conns;
+    if (wait) pthread_cond_wait (&serve.closed, &serve.lock);
+    pthread_mutex_unlock (&serve.lock);
+    if (!wait) break;
+    }
+
+  // Stop answering the connections there are, and wait for their 
+  //  threads to finish with serve
+  close (fd);
+  pthread_mutex_lock (&serve.lock);
+  ServeConn *conn;
+  for (conn = serve.conns; conn; conn = conn->next)
+    shutdown (conn->fd, SHUT_RDWR);
+  while (serve.conns)
+    pthread_cond_wait (&serve.closed, &serve.lock);
+  pthread_mutex_unlock (&serve.lock);
+
+  int i;
+  for (i = 0; i < serve.n_workers; i++)
+    if (worker_free) worker_free (serve.workers[i]);
+  free (serve.workers);
+  pthread_mutex_destroy (&serve.lock);
+  pthread_cond_destroy (&serve.returned);
+  pthread_cond_destroy (&serve.closed);
+  errno = error;
+  return -1;
+  }
+
+#else
+
+/*
+ * There are no Unix domain sockets on Windows
+ */
+int serve_socket (const char *path, int threads, ServeFunc func,
+    void *data, void *(*worker_new) (void), void (*worker_free) (void *))
+  {
+  errno = ENOSYS;
+  return -1;
+  }
+
+#endif
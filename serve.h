@@ -0,0 +1,43 @@
+/*==========================================================================
+gettags
+serve.h
+Copyright (c)2012-2024 Kevin Boone
+Distributed under the terms of the GNU Public Licence, v3.0
+==========================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include "types.h"
+
+/* A server reads requests, one to a line, and answers each with a reply
+ * of the form:
+ *   OK <length>\n<body>
+ * or
+ *   ERROR <length>\n<message>
+ * where length is the number of bytes in the body or message. A client
+ * can send as many requests as it likes without waiting for the replies,
+ * which come in the same order as the requests. */
+
+/* Answer one request, which has no line ending, and which the function
+ * can change. It writes the body of the reply, or the error message, to
+ * out, and returns TRUE for OK, or FALSE for ERROR. worker_data is what
+ * the server's worker_new function returned for the thread that is
+ * answering. */
+typedef BOOL (*ServeFunc) (char *request, FILE *out, void *data,
+                 void *worker_data);
+
+/* Answer requests from stdin on stdout until stdin ends */
+int        serve_stdio (ServeFunc func, void *data,
+              void *(*worker_new) (void), void (*worker_free) (void *));
+
+/* Listen on a Unix domain socket, and answer the requests on any number
+ * of connections at once, each on a thread of its own, but no more than
+ * threads requests at a time, so there are only that many worker_datas.
+ * This only returns if the socket can't be made, or accept() fails, with
+ * -1 and errno set; it closes the connections there are first, and waits
+ * for their threads. An old socket at the same path is replaced. */
+int        serve_socket (const char *path, int threads, ServeFunc func,
+              void *data, void *(*worker_new) (void),
+              void (*worker_free) (void *));
+
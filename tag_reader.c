@@ -5,12 +5,30 @@ Copyright (c)2012-2018 Kevin Boone
 Distributed under the terms of the GNU Public Licence, v3.0
 ==========================================================================*/
   
+// 64-bit file offsets on 32-bit platforms, for audiobooks over 2GB
+#define _FILE_OFFSET_BITS 64
+// For copy_file_range() 
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+// SSE2 and AVX2 text conversion, chosen at runtime -- see UNICODE SUPPORT
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TAG_X86_SIMD 1
+#include <immintrin.h>
+#endif
 #include "types.h"
 #include "tag_reader.h"
 
@@ -20,6 +38,620 @@ Distributed under the terms of the GNU Public Licence, v3.0
 // Set this to true for lots of incomprehensible debug gibberish 
 BOOL tag_debug = FALSE; 
 
+// What to do with text that should be UTF-8 -- see tag_reader.h
+TagUTF8Repair tag_utf8_repair = TAG_UTF8_TRUST;
+
+// Running totals of the system calls made on behalf of callers. Files 
+//  may be read on many threads at once, so the totals are atomic
+TagStats tag_stats;
+
+#define TAG_STAT_ADD(field, n) \
+  __atomic_fetch_add (&tag_stats.field, (n), __ATOMIC_RELAXED)
+
+/**********************************************************************
+  FILE ACCESS
+*********************************************************************/
+
+/*
+ * All the format parsers read their input through a TagStream, rather than
+ * directly from a file handle. The file is opened once, and the first
+ * TAG_PREFIX_SIZE bytes are read in one go. The prefix is used to work out
+ * what kind of file we have, and it satisfies the parser's early reads
+ * (which are usually all it needs, at least for the headers) without any
+ * more system calls. Seeks are lazy -- the file handle is only
+ * repositioned when a read can't be satisfied from the prefix. Small
+ * reads beyond the prefix are satisfied from a read-ahead window of the
+ * same size, so that walking a chain of headers -- ID3v2 frames, MP4 
+ * atoms, Ogg pages -- doesn't cost a read() for each one.
+ *
+ * A stream can also be made over a file that is already in memory, 
+ * either because it has been mapped, or because the caller supplied
+ * it. In that case the "prefix" is just the whole file, and there is
+ * no file handle.
+ */
+#define TAG_PREFIX_SIZE 4096
+
+#define TAG_WINDOW_SIZE 4096
+
+// Largest single read() we'll ask for when reading a big region
+#define TAG_READ_CHUNK (1024 * 1024)
+
+// Smallest scratch buffer worth allocating
+#define TAG_SCRATCH_MIN (64 * 1024)
+
+/*
+ * A buffer for data that has to be copied out of the file before it can
+ * be parsed -- frames, blocks, and packets that are not in the prefix,
+ * and too big for the read-ahead window. It only ever grows, so a 
+ * TagContext that keeps one for a whole batch of files soon stops
+ * allocating at all.
+ */
+typedef struct
+  {
+  BYTE *buff;
+  int size;
+  } TagScratch;
+
+/*
+ * What a TagContext holds between files: the arena that each file's 
+ * TagData comes from, which is reset for each file, and the scratch 
+ * buffer.
+ */
+struct _TagContext
+  {
+  TagArena *arena;
+  TagScratch scratch;
+  };
+
+typedef struct
+  {
+  int f;               // File handle, or -1 for an in-memory file
+  const BYTE *prefix;  // The first prefix_len bytes of the file
+  off_t prefix_len;
+  BOOL complete;       // The prefix is the whole file
+  BOOL views;          // Tag values may point into the prefix, rather 
+                       //  than being copied, because it will outlive 
+                       //  the TagData
+  off_t pos;           // Position of the next read, as seen by the parser
+  off_t fpos;          // Actual position of the file handle
+  const char *file;    // Name of the file, or NULL for an in-memory file
+  struct _TagWanted *wanted; // The tags the caller wants, or NULL for all
+  off_t win_start;     // File position of the read-ahead window
+  int win_len;         // Bytes in the window, or zero if it is empty
+  TagScratch *scratch; // own_scratch, or a TagContext's
+  TagScratch own_scratch;
+  BYTE prefix_buff[TAG_PREFIX_SIZE];
+  BYTE window[TAG_WINDOW_SIZE];
+  } TagStream;
+
+typedef enum
+  {
+  TAG_FORMAT_UNKNOWN = 0,
+  TAG_FORMAT_ID3V2,
+  TAG_FORMAT_FLAC,
+  TAG_FORMAT_OGG,
+  TAG_FORMAT_MP4
+  } TagFormat;
+
+/*
+ * Move the file handle to the stream's current position, if it isn't 
+ * already there. 
+ */
+static BOOL tag_stream_sync (TagStream *s)
+  {
+  if (s->fpos != s->pos)
+    {
+    TAG_STAT_ADD (seeks, 1);
+    if (lseek (s->f, s->pos, SEEK_SET) != s->pos) return FALSE;
+    s->fpos = s->pos;
+    }
+  return TRUE;
+  }
+
+/*
+ * Refill the read-ahead window from the current position. Returns FALSE
+ * at the end of the file, or on a read error.
+ */
+static BOOL tag_stream_fill_window (TagStream *s)
+  {
+  s->win_len = 0;
+  if (!tag_stream_sync (s)) return FALSE;
+  TAG_STAT_ADD (reads, 1);
+  int r = read (s->f, s->window, TAG_WINDOW_SIZE);
+  if (r <= 0) return FALSE;
+  TAG_STAT_ADD (bytes_read, r);
+  s->win_start = s->pos;
+  s->win_len = r;
+  s->fpos += r;
+  return TRUE;
+  }
+
+/*
+ * Read up to n bytes from the current position in the stream. Returns the
+ * number of bytes read, which will only be less than n at the end of the
+ * file, or if there was a read error.
+ */
+static int tag_stream_read (TagStream *s, void *buff, int n)
+  {
+  BYTE *out = (BYTE *)buff;
+  int got = 0;
+
+  if (s->pos < s->prefix_len)
+    {
+    off_t from_prefix = s->prefix_len - s->pos;
+    if (from_prefix > n) from_prefix = n;
+    memcpy (out, s->prefix + s->pos, from_prefix);
+    got += from_prefix;
+    s->pos += from_prefix;
+    }
+
+  while (got < n && !s->complete)
+    {
+    if (s->pos >= s->win_start && s->pos < s->win_start + s->win_len)
+      {
+      off_t from_window = s->win_start + s->win_len - s->pos;
+      if (from_window > n - got) from_window = n - got;
+      memcpy (out + got, s->window + (s->pos - s->win_start), from_window);
+      got += from_window;
+      s->pos += from_window;
+      }
+    else if (n - got < TAG_WINDOW_SIZE)
+      {
+      if (!tag_stream_fill_window (s)) break;
+      }
+    else
+      {
+      // Big reads go straight into the caller's buffer
+      if (!tag_stream_sync (s)) break;
+      int to_read = n - got;
+      if (to_read > TAG_READ_CHUNK) to_read = TAG_READ_CHUNK;
+      TAG_STAT_ADD (reads, 1);
+      int r = read (s->f, out + got, to_read);
+      if (r <= 0) break;
+      TAG_STAT_ADD (bytes_read, r);
+      got += r;
+      s->pos += r;
+      s->fpos += r;
+      }
+    }
+
+  return got;
+  }
+
+/*
+ * Make sure that the stream's scratch buffer can hold n bytes, keeping
+ * what is already in it. Returns NULL if we run out of memory.
+ */
+static BYTE *tag_stream_scratch (TagStream *s, int n)
+  {
+  TagScratch *sc = s->scratch;
+  if (n > sc->size)
+    {
+    int size = sc->size < TAG_SCRATCH_MIN / 2 ? TAG_SCRATCH_MIN : sc->size * 2;
+    if (size < n) size = n;
+    BYTE *buff = realloc (sc->buff, size);
+    if (!buff) return NULL;
+    sc->buff = buff;
+    sc->size = size;
+    }
+  return sc->buff;
+  }
+
+/*
+ * Get a pointer to the next n bytes of the stream, and advance past them.
+ * If the bytes are all in the prefix or the read-ahead window, the 
+ * pointer is into that, and nothing is copied; a pointer into the window
+ * is only valid until the next read from the stream. Otherwise the bytes
+ * are read into the stream's scratch buffer, and *copied_ret is set; the
+ * pointer is then valid until the next fetch. Returns the number of bytes 
+ * available, which will be less than n if the file is too short, or -1 
+ * if we run out of memory.
+ */
+static int tag_stream_fetch (TagStream *s, int n, const BYTE **data_ret,
+    BOOL *copied_ret)
+  {
+  *copied_ret = FALSE;
+  if (s->pos + n <= s->prefix_len || s->complete)
+    {
+    off_t avail = s->prefix_len - s->pos;
+    if (avail < 0) avail = 0;
+    if (avail > n) avail = n;
+    *data_ret = s->prefix + s->pos;
+    s->pos += avail;
+    return avail;
+    }
+
+  if (n <= TAG_WINDOW_SIZE && s->pos >= s->prefix_len)
+    {
+    if (s->pos < s->win_start || s->pos + n > s->win_start + s->win_len)
+      tag_stream_fill_window (s);
+    if (s->pos >= s->win_start && s->pos + n <= s->win_start + s->win_len)
+      {
+      *data_ret = s->window + (s->pos - s->win_start);
+      s->pos += n;
+      return n;
+      }
+    }
+
+  BYTE *buff = tag_stream_scratch (s, n);
+  if (!buff) return -1;
+  *copied_ret = TRUE;
+  *data_ret = buff;
+  return tag_stream_read (s, buff, n);
+  }
+
+/*
+ * Set the position of the next read. whence is SEEK_SET or SEEK_CUR; no
+ * I/O is done here.
+ */
+static void tag_stream_seek (TagStream *s, off_t offset, int whence)
+  {
+  if (whence == SEEK_CUR)
+    s->pos += offset;
+  else
+    s->pos = offset;
+  }
+
+/*
+ * Open a file and read its prefix. If this succeeds, the caller must
+ * call tag_stream_close() when finished with the stream.
+ */
+static TagResult tag_stream_open (TagStream *s, const char *file)
+  {
+  TAG_STAT_ADD (opens, 1);
+  s->f = open (file, O_RDONLY | O_BINARY);
+  if (s->f < 0) return TAG_READERROR;
+
+  s->prefix = s->prefix_buff;
+  s->prefix_len = 0;
+  while (s->prefix_len < TAG_PREFIX_SIZE)
+    {
+    TAG_STAT_ADD (reads, 1);
+    int r = read (s->f, s->prefix_buff + s->prefix_len, 
+      TAG_PREFIX_SIZE - s->prefix_len);
+    if (r < 0)
+      {
+      close (s->f);
+      return TAG_READERROR;
+      }
+    if (r == 0) break;
+    TAG_STAT_ADD (bytes_read, r);
+    s->prefix_len += r;
+    }
+
+  // A short prefix means that the prefix was the whole file
+  s->complete = s->prefix_len < TAG_PREFIX_SIZE;
+  s->views = FALSE;
+  s->pos = 0;
+  s->fpos = s->prefix_len;
+  s->file = file;
+  s->wanted = NULL;
+  s->win_start = 0;
+  s->win_len = 0;
+  s->scratch = &s->own_scratch;
+  s->own_scratch.buff = NULL;
+  s->own_scratch.size = 0;
+  return TAG_OK;
+  }
+
+/*
+ * Make a stream over a file that is already in memory. If views is TRUE,
+ * tag values will point directly into the memory where possible, so it 
+ * must remain valid for as long as the TagData does.
+ */
+static void tag_stream_open_memory (TagStream *s, const BYTE *buff, 
+    size_t len, BOOL views)
+  {
+  s->f = -1;
+  s->prefix = buff;
+  s->prefix_len = len;
+  s->complete = TRUE;
+  s->views = views;
+  s->pos = 0;
+  s->fpos = 0;
+  s->file = NULL;
+  s->wanted = NULL;
+  s->win_start = 0;
+  s->win_len = 0;
+  s->scratch = &s->own_scratch;
+  s->own_scratch.buff = NULL;
+  s->own_scratch.size = 0;
+  }
+
+/*
+ * Close the stream's file, if it has one. A TagContext's scratch buffer
+ * is left for the next file.
+ */
+static void tag_stream_close (TagStream *s)
+  {
+  if (s->f >= 0) close (s->f);
+  free (s->own_scratch.buff);
+  }
+
+/*
+ * Work out the file format from the first few bytes of the file. For MP4
+ * there is no single magic number, but the file should start with an
+ * atom whose type is one of the usual top-level ones.
+ */
+static TagFormat tag_sniff_format (const BYTE *p, off_t len)
+  {
+  if (len >= 3 && memcmp (p, "ID3", 3) == 0) return TAG_FORMAT_ID3V2;
+  if (len >= 4 && memcmp (p, "fLaC", 4) == 0) return TAG_FORMAT_FLAC;
+  if (len >= 4 && memcmp (p, "OggS", 4) == 0) return TAG_FORMAT_OGG;
+  if (len >= 8)
+    {
+    const char *type = (const char *)p + 4;
+    if (memcmp (type, "ftyp", 4) == 0 || memcmp (type, "moov", 4) == 0
+        || memcmp (type, "mdat", 4) == 0 || memcmp (type, "free", 4) == 0
+        || memcmp (type, "skip", 4) == 0 || memcmp (type, "wide", 4) == 0)
+      return TAG_FORMAT_MP4;
+    }
+  return TAG_FORMAT_UNKNOWN;
+  }
+
+/**********************************************************************
+  ARENA ALLOCATION 
+*********************************************************************/
+
+/*
+ * Everything that belongs to a TagData -- the TagData itself, its Tags,
+ * their IDs and values -- is allocated from an arena, so that it can be 
+ * freed all at once, rather than one piece at a time. An arena is a 
+ * chain of blocks; allocation just moves a pointer along the current 
+ * block, moving on to the next (or a new one) when the current one is 
+ * full. Resetting an arena keeps its blocks for reuse, so that after the 
+ * first few files, a batch that reuses one arena does no allocation at 
+ * all.
+ */
+#define TAG_ARENA_BLOCK_SIZE 8192
+#define TAG_ARENA_ALIGN 16
+
+typedef struct _TagArenaBlock
+  {
+  struct _TagArenaBlock *next;
+  size_t size;   // Bytes available for allocation
+  size_t used;
+  } TagArenaBlock;
+
+// Allocations start this far into a block, to keep them aligned
+#define TAG_ARENA_HEADER_SIZE ((sizeof (TagArenaBlock) + TAG_ARENA_ALIGN - 1) \
+  & ~(size_t)(TAG_ARENA_ALIGN - 1))
+
+#define TAG_ARENA_DATA(b) ((BYTE *)(b) + TAG_ARENA_HEADER_SIZE)
+
+struct _TagArena
+  {
+  TagArenaBlock *first;
+  TagArenaBlock *current; // Blocks after this one are empty
+  };
+
+TagArena *tag_arena_new (void)
+  {
+  TagArena *arena = malloc (sizeof (TagArena));
+  if (arena) memset (arena, 0, sizeof (TagArena));
+  return arena;
+  }
+
+/*
+ * Make all the memory in an arena available for reuse. Anything 
+ * allocated from it is invalid after this.
+ */
+void tag_arena_reset (TagArena *arena)
+  {
+  arena->current = arena->first;
+  if (arena->current) arena->current->used = 0;
+  }
+
+void tag_arena_free (TagArena *arena)
+  {
+  if (!arena) return;
+  TagArenaBlock *b = arena->first;
+  while (b)
+    {
+    TagArenaBlock *next = b->next;
+    free (b);
+    b = next;
+    }
+  free (arena);
+  }
+
+/*
+ * Allocate n bytes from an arena. Returns NULL if we run out of memory.
+ */
+static void *tag_arena_alloc (TagArena *arena, size_t n)
+  {
+  n = (n + TAG_ARENA_ALIGN - 1) & ~(size_t)(TAG_ARENA_ALIGN - 1);
+
+  TagArenaBlock *b = arena->current;
+  while (b && b->size - b->used < n)
+    {
+    b = b->next;
+    if (b) b->used = 0;
+    }
+
+  if (!b)
+    {
+    size_t size = n > TAG_ARENA_BLOCK_SIZE ? n : TAG_ARENA_BLOCK_SIZE;
+    b = malloc (TAG_ARENA_HEADER_SIZE + size);
+    if (!b) return NULL;
+    b->size = size;
+    b->used = 0;
+    if (arena->current)
+      {
+      b->next = arena->current->next;
+      arena->current->next = b;
+      }
+    else
+      {
+      b->next = arena->first;
+      arena->first = b;
+      }
+    }
+
+  arena->current = b;
+  void *p = TAG_ARENA_DATA (b) + b->used;
+  b->used += n;
+  return p;
+  }
+
+/*
+ * Give back the end of the most recent allocation, which was of old_n 
+ * bytes at p, keeping only the first new_n. This is for when we have to 
+ * allocate for the worst case, before we know how much we need. If p 
+ * wasn't the most recent allocation, nothing happens.
+ */
+static void tag_arena_shrink (TagArena *arena, void *p, size_t old_n, 
+    size_t new_n)
+  {
+  TagArenaBlock *b = arena->current;
+  old_n = (old_n + TAG_ARENA_ALIGN - 1) & ~(size_t)(TAG_ARENA_ALIGN - 1);
+  new_n = (new_n + TAG_ARENA_ALIGN - 1) & ~(size_t)(TAG_ARENA_ALIGN - 1);
+  if (b && (BYTE *)p + old_n == TAG_ARENA_DATA (b) + b->used 
+      && new_n <= old_n)
+    b->used -= old_n - new_n;
+  }
+
+/*
+ * Copy at most len bytes of s, stopping at the first zero, into a new
+ * zero-terminated string in the arena
+ */
+static char *tag_strndup (TagArena *arena, const char *s, int len)
+{
+  const char *end = memchr (s, 0, len);
+  if (end) len = end - s;
+  char *ret = (char *) tag_arena_alloc (arena, len + 1);
+  if (!ret) return NULL;
+  memcpy (ret, s, len);
+  ret[len] = 0;
+  return ret;
+}
+
+/**********************************************************************
+  STRING POOL
+*********************************************************************/
+
+/*
+ * A TagPool is a hash table of strings, each of which is stored once, in
+ * the pool's arena. The table uses open addressing, and is doubled when 
+ * it gets half full, so lookups rarely have to probe far. 
+ */
+#define TAG_POOL_INITIAL_SIZE 1024
+
+typedef struct
+  {
+  const char *s;     // NULL if this slot is empty
+  int len;
+  unsigned int hash;
+  } TagPoolEntry;
+
+struct _TagPool
+  {
+  TagArena *arena;
+  TagPoolEntry *table;
+  int size; // A power of two
+  int count;
+  };
+
+// FNV-1a
+static unsigned int tag_pool_hash (const char *s, int len)
+  {
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < len; i++)
+    {
+    h ^= (BYTE)s[i];
+    h *= 16777619u;
+    }
+  return h;
+  }
+
+TagPool *tag_pool_new (void)
+  {
+  TagPool *pool = malloc (sizeof (TagPool));
+  if (!pool) return NULL;
+  pool->arena = tag_arena_new ();
+  pool->table = calloc (TAG_POOL_INITIAL_SIZE, sizeof (TagPoolEntry));
+  if (!pool->arena || !pool->table)
+    {
+    tag_arena_free (pool->arena);
+    free (pool->table);
+    free (pool);
+    return NULL;
+    }
+  pool->size = TAG_POOL_INITIAL_SIZE;
+  pool->count = 0;
+  return pool;
+  }
+
+void tag_pool_free (TagPool *pool)
+  {
+  if (!pool) return;
+  tag_arena_free (pool->arena);
+  free (pool->table);
+  free (pool);
+  }
+
+// The number of different strings in the pool
+int tag_pool_count (const TagPool *pool)
+  {
+  return pool->count;
+  }
+
+static BOOL tag_pool_grow (TagPool *pool)
+  {
+  int size = pool->size * 2;
+  TagPoolEntry *table = calloc (size, sizeof (TagPoolEntry));
+  if (!table) return FALSE;
+  int i;
+  for (i = 0; i < pool->size; i++)
+    {
+    TagPoolEntry *e = &pool->table[i];
+    if (!e->s) continue;
+    int j = e->hash & (size - 1);
+    while (table[j].s) j = (j + 1) & (size - 1);
+    table[j] = *e;
+    }
+  free (pool->table);
+  pool->table = table;
+  pool->size = size;
+  return TRUE;
+  }
+
+/*
+ * Get the pooled copy of the len bytes at s. If there isn't one, and 
+ * adopt is TRUE, s itself is added to the pool -- it must be 
+ * zero-terminated, and allocated from the pool's arena. Otherwise a
+ * copy is made. Returns NULL if we run out of memory.
+ */
+static const char *tag_pool_intern (TagPool *pool, const char *s, int len,
+    BOOL adopt)
+  {
+  if ((pool->count + 1) * 2 > pool->size && !tag_pool_grow (pool)) 
+    return NULL;
+
+  unsigned int hash = tag_pool_hash (s, len);
+  int mask = pool->size - 1;
+  int j = hash & mask;
+  while (pool->table[j].s)
+    {
+    TagPoolEntry *e = &pool->table[j];
+    if (e->hash == hash && e->len == len && memcmp (e->s, s, len) == 0)
+      return e->s;
+    j = (j + 1) & mask;
+    }
+
+  if (!adopt)
+    {
+    s = tag_strndup (pool->arena, s, len);
+    if (!s) return NULL;
+    }
+  pool->table[j].s = s;
+  pool->table[j].len = len;
+  pool->table[j].hash = hash;
+  pool->count++;
+  return s;
+  }
+
 /**********************************************************************
   UNICODE SUPPORT
 *********************************************************************/
@@ -117,8 +749,11 @@ static UTFConversionResult _convert_utf16_to_utf8 (const UTF16** sourceStart,
       switch (bytesToWrite) 
       { /* note: everything falls through. */
         case 4: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
+          /* fall through */
         case 3: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
+          /* fall through */
         case 2: *--target = (UTF8)((ch | byteMark) & byteMask); ch >>= 6;
+          /* fall through */
         case 1: *--target =  (UTF8)(ch | firstByteMark[bytesToWrite]);
       }
       target += bytesToWrite;
@@ -128,107 +763,1897 @@ static UTFConversionResult _convert_utf16_to_utf8 (const UTF16** sourceStart,
   return result;
 }
 
-// Caller must free string returned
-// len is the length in bytes of the UTF16, including the BOM if present
-static char *tag_convert_utf16_to_utf8 (int has_bom, const UTF16 *s, int len)
-{
-  // Guess final UTF8 size -- not going to be 
-  // more than double the UTF16
-
-  int utf8_len = len * 2;
-  UTF8 *target = (UTF8 *) malloc (utf8_len);   
-  memset (target, 0, utf8_len);
-  UTF8 *t = target;
+/*
+ * ID3v2 UTF-16 text may be in either byte order, and it is at an odd 
+ * offset in the frame, so it is read a byte at a time, or with unaligned
+ * vector loads. Conversion takes two passes: one to find the end of the 
+ * text and the length of its UTF-8, so that the result can be allocated 
+ * at exactly the right size, and one to convert it. Where the CPU 
+ * supports it, the passes deal with 8 or 16 units at a time using SSE2 
+ * or AVX2, for as long as the text is in the BMP (for the first pass) or
+ * ASCII (for the second). Anything else goes through the scalar code, 
+ * TAG_UTF16_CHUNK units at a time, before trying the vector code again.
+ * Each time the vector code gets nowhere, the scalar code is given twice
+ * as many units, so that text that is mostly surrogate pairs, say, isn't
+ * slowed down by trying the vectors every few characters.
+ */
+#define TAG_UTF16_CHUNK 16
 
-  // Do we need to swap byte order as well as skipping the BOM? 
-  const UTF16 *start = s;
+static inline UTF16 tag_utf16_unit (const BYTE *p, BOOL big_endian)
+  {
+  return big_endian ? (UTF16)((p[0] << 8) | p[1]) 
+    : (UTF16)(p[0] | (p[1] << 8));
+  }
 
-  int utf16_len; 
-  if (has_bom) 
-    {
-    utf16_len = len / sizeof (UTF16) - 1;
-    start += 1;
-    //utf16_len -= 1;
-    }
-  else
+/*
+ * The first pass over a chunk of up to limit of the n units at s, 
+ * stopping after a zero unit, if there is one. Adds the length of the 
+ * chunk's UTF-8 to *len, and returns the number of units in the chunk, 
+ * or -1 if the text ends with an unpaired high surrogate. This follows 
+ * the rules of _convert_utf16_to_utf8(), which does the conversion. 
+ * big_endian is a constant wherever this is inlined, so the compiler 
+ * makes a loop for each byte order.
+ */
+static inline __attribute__((always_inline)) int tag_utf16_len_run 
+    (const BYTE *s, int n, int limit, BOOL big_endian, int *len, 
+    BOOL *terminated)
+  {
+  if (limit > n) limit = n;
+  int i = 0;
+  while (i < limit)
     {
-    utf16_len = len / sizeof (UTF16);
+    UTF16 ch = tag_utf16_unit (s + 2 * i++, big_endian);
+    if (ch < 0x80)
+      {
+      *len += 1;
+      if (ch == 0)
+        {
+        *terminated = TRUE;
+        break;
+        }
+      }
+    else if (ch < 0x800)
+      *len += 2;
+    else if (ch >= UNI_SUR_HIGH_START && ch <= UNI_SUR_HIGH_END)
+      {
+      if (i == n) return -1;
+      UTF16 ch2 = tag_utf16_unit (s + 2 * i, big_endian);
+      if (ch2 >= UNI_SUR_LOW_START && ch2 <= UNI_SUR_LOW_END)
+        {
+        *len += 4;
+        i++;
+        }
+      else
+        *len += 3;
+      }
+    else
+      *len += 3;
     }
+  return i;
+  }
 
-  UTFConversionResult ret = _convert_utf16_to_utf8
-    (&start, start + utf16_len, 
-     &t, t + utf8_len);
-  if (ret != conversionOK )
-    strncpy ((char *)target, "Unicode error", utf8_len - 1);
-
-  return (char*) target;
-}
-
-static unsigned char *tag_convert_iso8859_to_utf8 
-  (const unsigned char *s, int len)
-{
-  unsigned char *buff = (unsigned char *) malloc (len * 2); // Worst case
-  memset (buff, 0, len * 2);
-  unsigned char *out = buff;
-  
-  int i = 0;
-  while (i < len)
+static int tag_utf16_len_chunk (const BYTE *s, int n, int limit, 
+    BOOL big_endian, int *len, BOOL *terminated)
   {
-    if (s[i] < 128) { *out++ = s[i]; }
-    else { *out++ = (0xc2+(s[i]>0xbf)); *out++ = ((s[i]&0x3f)+0x80); }
-  i++;
+  if (big_endian)
+    return tag_utf16_len_run (s, n, limit, TRUE, len, terminated);
+  return tag_utf16_len_run (s, n, limit, FALSE, len, terminated);
   }
-  return buff;
-}
-
-/**********************************************************************
-  MP3/ID3v2 SUPPORT
-*********************************************************************/
 
 /*
- * Read the next frame. f is a file handle open at the start of the
- * frame. Version is the ID3v2 major version, i.e for ID3v2.3 it is 3
+ * The second pass over a chunk of up to limit of the n units at s, which
+ * must already have been through the first. If the chunk would end with
+ * a high surrogate, the next unit is included. Writes the UTF-8 to out, 
+ * and returns the number of units converted, with the number of bytes 
+ * written in *out_len. As with the first pass, big_endian is a constant
+ * wherever this is inlined.
  */
-static TagResult tag_read_frame (int f, int version, int *carry_on,
-   char **frame_id_ret, unsigned char **data_ret, int *total_bytes, 
-   TagData *tag_data)
-{
-  unsigned char buff[20];
-  unsigned char frameId[5]; // leave room for a \0
-  unsigned char b1, b2, b3, b4; 
-  int frame_len = 0;
-  int header_len = 0;
-  *frame_id_ret = NULL;
-  *data_ret = NULL;
+static inline __attribute__((always_inline)) int tag_utf16_convert_run 
+    (const BYTE *s, int n, int limit, BOOL big_endian, UTF8 *out, 
+    UTF8 *out_end, int *out_len)
+  {
+  int count = n < limit ? n : limit;
+  UTF8 *t = out;
+  int i;
 
-  memset (frameId, 0, sizeof (frameId));
+  // Characters in the BMP are one unit each, and the rest are proper
+  //  surrogate pairs, nearly always, which is simple enough to do here
+  for (i = 0; i < count; i++)
+    {
+    UTF16 ch = tag_utf16_unit (s + 2 * i, big_endian);
+    UTF16 ch2;
+    if (ch < 0x80)
+      *t++ = (UTF8)ch;
+    else if (ch < 0x800)
+      {
+      *t++ = (UTF8)(0xC0 | (ch >> 6));
+      *t++ = (UTF8)(0x80 | (ch & 0x3F));
+      }
+    else if ((ch & 0xF800) != UNI_SUR_HIGH_START)
+      {
+      *t++ = (UTF8)(0xE0 | (ch >> 12));
+      *t++ = (UTF8)(0x80 | ((ch >> 6) & 0x3F));
+      *t++ = (UTF8)(0x80 | (ch & 0x3F));
+      }
+    else if (ch <= UNI_SUR_HIGH_END && i + 1 < n 
+        && ((ch2 = tag_utf16_unit (s + 2 * i + 2, big_endian)) & 0xFC00) 
+          == UNI_SUR_LOW_START)
+      {
+      UTF32 c = ((ch - UNI_SUR_HIGH_START) << halfShift) 
+        + (ch2 - UNI_SUR_LOW_START) + halfBase;
+      *t++ = (UTF8)(0xF0 | (c >> 18));
+      *t++ = (UTF8)(0x80 | ((c >> 12) & 0x3F));
+      *t++ = (UTF8)(0x80 | ((c >> 6) & 0x3F));
+      *t++ = (UTF8)(0x80 | (c & 0x3F));
+      i++;
+      if (i == count) count++;
+      }
+    else
+      break;
+    }
+
+  if (i < count)
+    {
+    // Unpaired surrogates are for the Unicode Consortium code, which 
+    //  wants aligned units in our byte order
+    UTF16 units[TAG_UTF16_CHUNK + 1];
+    if (count - i > TAG_UTF16_CHUNK) count = i + TAG_UTF16_CHUNK;
+    int j;
+    for (j = i; j < count; j++)
+      units[j - i] = tag_utf16_unit (s + 2 * j, big_endian);
+    UTF16 last = units[count - 1 - i];
+    if (count < n && last >= UNI_SUR_HIGH_START && last <= UNI_SUR_HIGH_END)
+      {
+      units[count - i] = tag_utf16_unit (s + 2 * count, big_endian);
+      count++;
+      }
+    // A high surrogate at the very end is left for the next chunk
+    const UTF16 *source = units;
+    _convert_utf16_to_utf8 (&source, units + count - i, &t, out_end);
+    count = i + (source - units);
+    }
+
+  *out_len = t - out;
+  return count;
+  }
+
+static int tag_utf16_convert_chunk (const BYTE *s, int n, int limit, 
+    BOOL big_endian, UTF8 *out, UTF8 *out_end, int *out_len)
+  {
+  if (big_endian)
+    return tag_utf16_convert_run (s, n, limit, TRUE, out, out_end, 
+      out_len);
+  return tag_utf16_convert_run (s, n, limit, FALSE, out, out_end, out_len);
+  }
+
+/*
+ * The length of the UTF-8 character at s, which has n bytes left, or 
+ * zero if it isn't valid. Overlong forms, surrogates, and anything 
+ * beyond U+10FFFF are not valid. 
+ */
+static inline int tag_utf8_char_len (const BYTE *s, int n)
+  {
+  BYTE c = s[0];
+  if (c < 0x80) return 1;
+  if (c < 0xC2) return 0;
+  if (c < 0xE0)
+    return n >= 2 && (s[1] & 0xC0) == 0x80 ? 2 : 0;
+  if (c < 0xF0)
+    {
+    if (n < 3 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80) return 0;
+    if (c == 0xE0 && s[1] < 0xA0) return 0; // Overlong
+    if (c == 0xED && s[1] >= 0xA0) return 0; // Surrogate
+    return 3;
+    }
+  if (c < 0xF5)
+    {
+    if (n < 4 || (s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80
+        || (s[3] & 0xC0) != 0x80) return 0;
+    if (c == 0xF0 && s[1] < 0x90) return 0; // Overlong
+    if (c == 0xF4 && s[1] >= 0x90) return 0; // Beyond U+10FFFF
+    return 4;
+    }
+  return 0;
+  }
+
+/*
+ * Check the UTF-8 at s, of length n, from *i up to end, or the end of 
+ * the character that straddles it. Returns FALSE if it's not valid.
+ */
+static inline BOOL tag_utf8_check_run (const BYTE *s, int n, int *i, 
+    int end)
+  {
+  while (*i < end)
+    {
+    if (s[*i] < 0x80)
+      (*i)++;
+    else
+      {
+      int len = tag_utf8_char_len (s + *i, n - *i);
+      if (!len) return FALSE;
+      *i += len;
+      }
+    }
+  return TRUE;
+  }
+
+/*
+ * The vector code works through whole vectors, and returns the number of
+ * units it dealt with, stopping at the first vector that it can't handle,
+ * and leaving that to the scalar code. utf16_len adds the length of the 
+ * UTF-8 to *len, for vectors that have no zeros, and whose surrogates 
+ * are all in pairs; 
+ * utf16_write converts vectors that are all ASCII or, where the CPU can
+ * shuffle bytes, are all one- and two-byte characters, all three-byte
+ * characters, or ASCII and surrogate pairs, advancing *out. It may store
+ * up to TAG_VECTOR_SLACK bytes beyond the end of the UTF-8 that it writes. latin1_len and latin1_write
+ * do the same for ISO-8859-1 bytes, which must not include a zero for 
+ * latin1_write. utf8_valid checks a whole text, and says whether it is
+ * valid UTF-8.
+ */
+typedef struct
+  {
+  int (*utf16_len) (const BYTE *s, int n, BOOL big_endian, int *len);
+  int (*utf16_write) (const BYTE *s, int n, BOOL big_endian, UTF8 **out);
+  int (*latin1_len) (const BYTE *s, int n, int *len);
+  int (*latin1_write) (const BYTE *s, int n, UTF8 **out);
+  BOOL (*utf8_valid) (const BYTE *s, int n);
+  } TagTextVector;
+
+#define TAG_VECTOR_SLACK 16
+
+#ifdef TAG_X86_SIMD
+
+// The lane counts are flushed before they can overflow
+#define TAG_VECTOR_FLUSH 8192
+
+__attribute__((target ("sse2")))
+static inline __m128i tag_utf16_load_sse2 (const BYTE *p, BOOL big_endian)
+  {
+  __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+  if (big_endian) 
+    v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+  return v;
+  }
+
+// Add up the 16-bit lanes
+__attribute__((target ("sse2")))
+static inline int tag_sum_epi16_sse2 (__m128i v)
+  {
+  __m128i s = _mm_madd_epi16 (v, _mm_set1_epi16 (1));
+  s = _mm_add_epi32 (s, _mm_shuffle_epi32 (s, 0x4E));
+  s = _mm_add_epi32 (s, _mm_shuffle_epi32 (s, 0xB1));
+  return _mm_cvtsi128_si32 (s);
+  }
+
+__attribute__((target ("sse2")))
+static int tag_utf16_len_sse2 (const BYTE *s, int n, BOOL big_endian, 
+    int *len)
+  {
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i not_ascii = _mm_set1_epi16 ((short)0xFF80);
+  const __m128i not_two = _mm_set1_epi16 ((short)0xF800);
+  const __m128i surrogate = _mm_set1_epi16 ((short)0xD800);
+  const __m128i not_low = _mm_set1_epi16 ((short)0xFC00);
+  const __m128i high = _mm_set1_epi16 ((short)0xD800);
+  const __m128i low = _mm_set1_epi16 ((short)0xDC00);
+  // Each unit makes three bytes, less one if it makes fewer than three,
+  //  one more if it makes fewer than two, and one more if it's half of a
+  //  surrogate pair. The comparisons give -1 for true, so acc counts down.
+  __m128i acc = zero;
+  int i, vectors = 0;
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+    __m128i v = tag_utf16_load_sse2 (s + 2 * i, big_endian);
+    __m128i top5 = _mm_and_si128 (v, not_two);
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (v, zero))) break;
+    __m128i sur = _mm_cmpeq_epi16 (top5, surrogate);
+    if (_mm_movemask_epi8 (sur))
+      {
+      // Each high surrogate must be followed by a low one, in this vector
+      int h = _mm_movemask_epi8 (_mm_cmpeq_epi16 (
+        _mm_and_si128 (v, not_low), high));
+      int l = _mm_movemask_epi8 (_mm_cmpeq_epi16 (
+        _mm_and_si128 (v, not_low), low));
+      if (l != ((h << 2) & 0xFFFF) || (h & 0xC000)) break;
+      acc = _mm_add_epi16 (acc, sur);
+      }
+    acc = _mm_add_epi16 (acc, _mm_cmpeq_epi16 (top5, zero));
+    acc = _mm_add_epi16 (acc, 
+      _mm_cmpeq_epi16 (_mm_and_si128 (v, not_ascii), zero));
+    if (++vectors == TAG_VECTOR_FLUSH)
+      {
+      *len += tag_sum_epi16_sse2 (acc);
+      acc = zero;
+      vectors = 0;
+      }
+    }
+  *len += 3 * i + tag_sum_epi16_sse2 (acc);
+  return i;
+  }
+
+__attribute__((target ("sse2")))
+static int tag_utf16_write_sse2 (const BYTE *s, int n, BOOL big_endian, 
+    UTF8 **out)
+  {
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i not_ascii = _mm_set1_epi16 ((short)0xFF80);
+  UTF8 *t = *out;
+  int i;
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+    __m128i v = tag_utf16_load_sse2 (s + 2 * i, big_endian);
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_and_si128 (v, not_ascii),
+        zero)) != 0xFFFF) 
+      break;
+    _mm_storel_epi64 ((__m128i *)t, _mm_packus_epi16 (v, v));
+    t += 8;
+    }
+  *out = t;
+  return i;
+  }
+
+/*
+ * Without byte shuffles, the best we can do is to skip ASCII, which is 
+ * most text in tags, a vector at a time
+ */
+__attribute__((target ("sse2")))
+static BOOL tag_utf8_valid_sse2 (const BYTE *s, int n)
+  {
+  int i = 0;
+  while (i < n)
+    {
+    for (; i + 16 <= n; i += 16)
+      if (_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)(s + i)))) 
+        break;
+    if (!tag_utf8_check_run (s, n, &i, 
+        i + TAG_UTF16_CHUNK < n ? i + TAG_UTF16_CHUNK : n))
+      return FALSE;
+    }
+  return TRUE;
+  }
+
+// Add up the 64-bit lanes
+__attribute__((target ("sse2")))
+static inline int tag_sum_epi64_sse2 (__m128i v)
+  {
+  return _mm_cvtsi128_si32 (_mm_add_epi64 (v, _mm_shuffle_epi32 (v, 0x4E)));
+  }
+
+__attribute__((target ("sse2")))
+static int tag_latin1_len_sse2 (const BYTE *s, int n, int *len)
+  {
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i one = _mm_set1_epi8 (1);
+  // Each byte with its top bit set makes one more byte of UTF-8
+  __m128i acc = zero;
+  int i;
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+    __m128i v = _mm_loadu_si128 ((const __m128i *)(s + i));
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero))) break;
+    if (_mm_movemask_epi8 (v))
+      acc = _mm_add_epi64 (acc, _mm_sad_epu8 (
+        _mm_and_si128 (_mm_cmplt_epi8 (v, zero), one), zero));
+    }
+  *len += i + tag_sum_epi64_sse2 (acc);
+  return i;
+  }
+
+__attribute__((target ("sse2")))
+static int tag_latin1_write_sse2 (const BYTE *s, int n, UTF8 **out)
+  {
+  UTF8 *t = *out;
+  int i;
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+    __m128i v = _mm_loadu_si128 ((const __m128i *)(s + i));
+    if (_mm_movemask_epi8 (v)) break;
+    _mm_storeu_si128 ((__m128i *)t, v);
+    t += 16;
+    }
+  *out = t;
+  return i;
+  }
+
+/*
+ * To convert eight characters of one or two bytes at once, each unit is 
+ * made into two bytes -- the character and a spare byte if it's ASCII, 
+ * or its two UTF-8 bytes if not -- and then the spare bytes are squeezed
+ * out with a byte shuffle. There's a shuffle for each combination of 
+ * ASCII and non-ASCII units, which is worked out when the program starts.
+ */
+static BYTE tag_utf16_shuffles[256][16];
+static BYTE tag_utf16_shuffle_len[256];
+
+__attribute__((constructor))
+static void tag_utf16_make_shuffles (void)
+  {
+  int mask, unit;
+  for (mask = 0; mask < 256; mask++)
+    {
+    int len = 0;
+    for (unit = 0; unit < 8; unit++)
+      {
+      tag_utf16_shuffles[mask][len++] = 2 * unit;
+      if (!(mask & (1 << unit)))
+        tag_utf16_shuffles[mask][len++] = 2 * unit + 1;
+      }
+    tag_utf16_shuffle_len[mask] = len;
+    while (len < 16) tag_utf16_shuffles[mask][len++] = 0x80;
+    }
+  }
+
+/*
+ * Squeeze the spare bytes of the units that are ASCII out of the two 
+ * bytes made for each of eight units, and store what's left at t, which
+ * must have room for 16 bytes. Returns the number of bytes that are left.
+ */
+__attribute__((target ("avx2")))
+static inline int tag_utf16_squeeze (__m128i pairs, __m128i ascii, UTF8 *t)
+  {
+  int mask = _mm_movemask_epi8 (_mm_packs_epi16 (ascii, 
+    _mm_setzero_si128 ()));
+  _mm_storeu_si128 ((__m128i *)t, _mm_shuffle_epi8 (pairs, 
+    _mm_loadu_si128 ((const __m128i *)tag_utf16_shuffles[mask])));
+  return tag_utf16_shuffle_len[mask];
+  }
+
+/*
+ * Convert eight units, which are all below 0x800, to t, which must have
+ * room for 16 bytes. Returns the number of bytes of UTF-8. 
+ */
+__attribute__((target ("avx2")))
+static inline int tag_utf16_write_two_byte (__m128i v, UTF8 *t)
+  {
+  __m128i ascii = _mm_cmpeq_epi16 (
+    _mm_and_si128 (v, _mm_set1_epi16 ((short)0xFF80)), _mm_setzero_si128 ());
+  __m128i lead = _mm_or_si128 (_mm_srli_epi16 (v, 6), 
+    _mm_set1_epi16 (0xC0));
+  __m128i trail = _mm_slli_epi16 (_mm_or_si128 (
+    _mm_and_si128 (v, _mm_set1_epi16 (0x3F)), _mm_set1_epi16 (0x80)), 8);
+  __m128i pairs = _mm_or_si128 (_mm_and_si128 (ascii, v), 
+    _mm_andnot_si128 (ascii, _mm_or_si128 (lead, trail)));
+  return tag_utf16_squeeze (pairs, ascii, t);
+  }
+
+/*
+ * Surrogate pairs are done in the same way, because each unit of a pair
+ * stands for two of the four bytes of its UTF-8: the high surrogate for
+ * the first two, and the low one for the last two, which need the last
+ * two bits of the high one as well. So this makes the two bytes for each
+ * of 16 units that are ASCII or surrogate pairs, or a high surrogate at
+ * the end, whose bytes are not wanted. high is set in the lanes of the 
+ * high surrogates.
+ */
+__attribute__((target ("avx2")))
+static inline __m256i tag_utf16_pair_bytes (__m256i v, __m256i ascii, 
+    __m256i high)
+  {
+  // The plane, plus one, is in bits 6 to 10 of the high surrogate once
+  //  0x40 has been added to it
+  __m256i q = _mm256_add_epi16 (v, _mm256_set1_epi16 (0x40));
+  __m256i first = _mm256_or_si256 (_mm256_or_si256 (
+    _mm256_and_si256 (_mm256_srli_epi16 (q, 8), _mm256_set1_epi16 (0x07)),
+    _mm256_and_si256 (_mm256_slli_epi16 (q, 6), 
+      _mm256_set1_epi16 (0x3F00))),
+    _mm256_set1_epi16 ((short)0x80F0));
+  // The unit before each one
+  __m256i prev = _mm256_alignr_epi8 (v, 
+    _mm256_permute2x128_si256 (v, v, 0x08), 14);
+  __m256i last = _mm256_or_si256 (_mm256_or_si256 (
+    _mm256_and_si256 (_mm256_slli_epi16 (prev, 4), 
+      _mm256_set1_epi16 (0x30)),
+    _mm256_and_si256 (_mm256_srli_epi16 (v, 6), _mm256_set1_epi16 (0x0F))),
+    _mm256_or_si256 (_mm256_and_si256 (_mm256_slli_epi16 (v, 8), 
+      _mm256_set1_epi16 (0x3F00)), _mm256_set1_epi16 ((short)0x8080)));
+  return _mm256_blendv_epi8 (_mm256_blendv_epi8 (last, first, high), 
+    v, ascii);
+  }
+
+__attribute__((target ("avx2")))
+static inline __m256i tag_utf16_load_avx2 (const BYTE *p, BOOL big_endian)
+  {
+  __m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+  if (big_endian) 
+    v = _mm256_or_si256 (_mm256_slli_epi16 (v, 8), 
+      _mm256_srli_epi16 (v, 8));
+  return v;
+  }
+
+__attribute__((target ("avx2")))
+static inline int tag_sum_epi16_avx2 (__m256i v)
+  {
+  __m128i s = _mm_add_epi32 (
+    _mm_madd_epi16 (_mm256_castsi256_si128 (v), _mm_set1_epi16 (1)),
+    _mm_madd_epi16 (_mm256_extracti128_si256 (v, 1), _mm_set1_epi16 (1)));
+  s = _mm_add_epi32 (s, _mm_shuffle_epi32 (s, 0x4E));
+  s = _mm_add_epi32 (s, _mm_shuffle_epi32 (s, 0xB1));
+  return _mm_cvtsi128_si32 (s);
+  }
+
+__attribute__((target ("avx2")))
+static int tag_utf16_len_avx2 (const BYTE *s, int n, BOOL big_endian, 
+    int *len)
+  {
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i not_ascii = _mm256_set1_epi16 ((short)0xFF80);
+  const __m256i not_two = _mm256_set1_epi16 ((short)0xF800);
+  const __m256i surrogate = _mm256_set1_epi16 ((short)0xD800);
+  const __m256i not_low = _mm256_set1_epi16 ((short)0xFC00);
+  const __m256i high = _mm256_set1_epi16 ((short)0xD800);
+  const __m256i low = _mm256_set1_epi16 ((short)0xDC00);
+  __m256i acc = zero;
+  int i, vectors = 0;
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+    __m256i v = tag_utf16_load_avx2 (s + 2 * i, big_endian);
+    __m256i top5 = _mm256_and_si256 (v, not_two);
+    if (_mm256_movemask_epi8 (_mm256_cmpeq_epi16 (v, zero))) break;
+    __m256i sur = _mm256_cmpeq_epi16 (top5, surrogate);
+    if (_mm256_movemask_epi8 (sur))
+      {
+      unsigned int h = _mm256_movemask_epi8 (_mm256_cmpeq_epi16 (
+        _mm256_and_si256 (v, not_low), high));
+      unsigned int l = _mm256_movemask_epi8 (_mm256_cmpeq_epi16 (
+        _mm256_and_si256 (v, not_low), low));
+      if (l != (h << 2) || (h & 0xC0000000u)) break;
+      acc = _mm256_add_epi16 (acc, sur);
+      }
+    acc = _mm256_add_epi16 (acc, _mm256_cmpeq_epi16 (top5, zero));
+    acc = _mm256_add_epi16 (acc, 
+      _mm256_cmpeq_epi16 (_mm256_and_si256 (v, not_ascii), zero));
+    if (++vectors == TAG_VECTOR_FLUSH)
+      {
+      *len += tag_sum_epi16_avx2 (acc);
+      acc = zero;
+      vectors = 0;
+      }
+    }
+  *len += 3 * i + tag_sum_epi16_avx2 (acc);
+  return i;
+  }
+
+/*
+ * Convert eight units, which are all three-byte characters, to t, which
+ * must have room for 24 bytes. The three bytes of each character are 
+ * worked out separately, and then interleaved.
+ */
+__attribute__((target ("avx2")))
+static inline void tag_utf16_write_three_byte (__m128i v, UTF8 *t)
+  {
+  const __m128i six = _mm_set1_epi16 (0x3F);
+  const __m128i trail = _mm_set1_epi16 (0x80);
+  __m128i b0 = _mm_or_si128 (_mm_srli_epi16 (v, 12), _mm_set1_epi16 (0xE0));
+  __m128i b1 = _mm_or_si128 (_mm_and_si128 (_mm_srli_epi16 (v, 6), six), 
+    trail);
+  __m128i b2 = _mm_or_si128 (_mm_and_si128 (v, six), trail);
+  __m128i a = _mm_packus_epi16 (b0, b1);
+  __m128i b = _mm_packus_epi16 (b2, b2);
+  __m128i first = _mm_or_si128 (
+    _mm_shuffle_epi8 (a, _mm_setr_epi8 (0, 8, -1, 1, 9, -1, 2, 10, -1, 
+      3, 11, -1, 4, 12, -1, 5)),
+    _mm_shuffle_epi8 (b, _mm_setr_epi8 (-1, -1, 0, -1, -1, 1, -1, -1, 2,
+      -1, -1, 3, -1, -1, 4, -1)));
+  __m128i rest = _mm_or_si128 (
+    _mm_shuffle_epi8 (a, _mm_setr_epi8 (13, -1, 6, 14, -1, 7, 15, -1, 
+      -1, -1, -1, -1, -1, -1, -1, -1)),
+    _mm_shuffle_epi8 (b, _mm_setr_epi8 (-1, 5, -1, -1, 6, -1, -1, 7,
+      -1, -1, -1, -1, -1, -1, -1, -1)));
+  _mm_storeu_si128 ((__m128i *)t, first);
+  _mm_storel_epi64 ((__m128i *)(t + 16), rest);
+  }
+
+__attribute__((target ("avx2")))
+static int tag_utf16_write_avx2 (const BYTE *s, int n, BOOL big_endian, 
+    UTF8 **out)
+  {
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i not_ascii = _mm256_set1_epi16 ((short)0xFF80);
+  const __m256i not_two = _mm256_set1_epi16 ((short)0xF800);
+  const __m256i surrogate = _mm256_set1_epi16 ((short)0xD800);
+  const __m256i not_low = _mm256_set1_epi16 ((short)0xFC00);
+  const __m256i high = _mm256_set1_epi16 ((short)0xD800);
+  const __m256i low = _mm256_set1_epi16 ((short)0xDC00);
+  UTF8 *t = *out;
+  int i;
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+    __m256i v = tag_utf16_load_avx2 (s + 2 * i, big_endian);
+    if ((unsigned int)_mm256_movemask_epi8 (_mm256_cmpeq_epi16 (
+        _mm256_and_si256 (v, not_ascii), zero)) == 0xFFFFFFFFu) 
+      {
+      // packus works within each 128-bit lane, so the bytes we want are 
+      //  in the first and third quarters
+      __m256i packed = _mm256_permute4x64_epi64 (
+        _mm256_packus_epi16 (v, v), 0xD8);
+      _mm_storeu_si128 ((__m128i *)t, _mm256_castsi256_si128 (packed));
+      t += 16;
+      }
+    else if ((unsigned int)_mm256_movemask_epi8 (_mm256_cmpeq_epi16 (
+        _mm256_and_si256 (v, not_two), zero)) == 0xFFFFFFFFu) 
+      {
+      t += tag_utf16_write_two_byte (_mm256_castsi256_si128 (v), t);
+      t += tag_utf16_write_two_byte (_mm256_extracti128_si256 (v, 1), t);
+      }
+    else 
+      {
+      __m256i top5 = _mm256_and_si256 (v, not_two);
+      __m256i sur = _mm256_cmpeq_epi16 (top5, surrogate);
+      __m256i ascii = _mm256_cmpeq_epi16 (_mm256_and_si256 (v, not_ascii), 
+        zero);
+      if (!_mm256_movemask_epi8 (_mm256_or_si256 (
+          _mm256_cmpeq_epi16 (top5, zero), sur)))
+        {
+        tag_utf16_write_three_byte (_mm256_castsi256_si128 (v), t);
+        tag_utf16_write_three_byte (_mm256_extracti128_si256 (v, 1), 
+          t + 24);
+        t += 48;
+        continue;
+        }
+
+      // Otherwise, it must be ASCII and whole surrogate pairs, though a
+      //  high surrogate at the end can be left for next time
+      if ((unsigned int)_mm256_movemask_epi8 (_mm256_or_si256 (sur, ascii))
+          != 0xFFFFFFFFu)
+        break;
+      __m256i is_high = _mm256_cmpeq_epi16 (_mm256_and_si256 (v, not_low), 
+        high);
+      unsigned int h = _mm256_movemask_epi8 (is_high);
+      unsigned int l = _mm256_movemask_epi8 (_mm256_cmpeq_epi16 (
+        _mm256_and_si256 (v, not_low), low));
+      BOOL drop = (h & 0xC0000000u) != 0;
+      if (l != ((h & 0x3FFFFFFFu) << 2)) break;
+      __m256i pairs = tag_utf16_pair_bytes (v, ascii, is_high);
+      t += tag_utf16_squeeze (_mm256_castsi256_si128 (pairs), 
+        _mm256_castsi256_si128 (ascii), t);
+      t += tag_utf16_squeeze (_mm256_extracti128_si256 (pairs, 1), 
+        _mm256_extracti128_si256 (ascii, 1), t);
+      if (drop)
+        {
+        t -= 2;
+        i--;
+        }
+      }
+    }
+  *out = t;
+  return i;
+  }
+
+__attribute__((target ("avx2")))
+static int tag_latin1_len_avx2 (const BYTE *s, int n, int *len)
+  {
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i one = _mm256_set1_epi8 (1);
+  __m256i acc = zero;
+  int i;
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *)(s + i));
+    if (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, zero))) break;
+    if (_mm256_movemask_epi8 (v))
+      acc = _mm256_add_epi64 (acc, _mm256_sad_epu8 (
+        _mm256_and_si256 (_mm256_cmpgt_epi8 (zero, v), one), zero));
+    }
+  *len += i + tag_sum_epi64_sse2 (_mm_add_epi64 (
+    _mm256_castsi256_si128 (acc), _mm256_extracti128_si256 (acc, 1)));
+  return i;
+  }
+
+/*
+ * ISO-8859-1 characters have the same numbers in Unicode, so vectors 
+ * that aren't ASCII are widened, and converted as UTF-16 below 0x100 
+ * would be.
+ */
+__attribute__((target ("avx2")))
+static int tag_latin1_write_avx2 (const BYTE *s, int n, UTF8 **out)
+  {
+  const __m128i zero = _mm_setzero_si128 ();
+  UTF8 *t = *out;
+  int i;
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *)(s + i));
+    if (!_mm256_movemask_epi8 (v))
+      {
+      _mm256_storeu_si256 ((__m256i *)t, v);
+      t += 32;
+      }
+    else
+      {
+      __m128i lo = _mm256_castsi256_si128 (v);
+      __m128i hi = _mm256_extracti128_si256 (v, 1);
+      t += tag_utf16_write_two_byte (_mm_unpacklo_epi8 (lo, zero), t);
+      t += tag_utf16_write_two_byte (_mm_unpackhi_epi8 (lo, zero), t);
+      t += tag_utf16_write_two_byte (_mm_unpacklo_epi8 (hi, zero), t);
+      t += tag_utf16_write_two_byte (_mm_unpackhi_epi8 (hi, zero), t);
+      }
+    }
+  *out = t;
+  return i;
+  }
+
+/*
+ * UTF-8 validation by table lookup, after Keiser and Lemire, "Validating
+ * UTF-8 in less than one instruction per byte" (2021). Nearly every 
+ * error can be seen in the first two bytes of a character: each byte's 
+ * top nibble, and the top and bottom nibbles of the byte before it, are
+ * looked up in tables whose bits are the errors that are possible with 
+ * those nibbles, and the three are AND-ed together. The only exceptions
+ * are a missing or extra third or fourth byte, which are found by 
+ * comparing where continuation bytes must be with where they are.
+ */
+#define TAG_UTF8_TOO_SHORT  0x01 // Lead byte, then not a continuation
+#define TAG_UTF8_TOO_LONG   0x02 // ASCII, then a continuation
+#define TAG_UTF8_OVERLONG_3 0x04 // E0 80..9F
+#define TAG_UTF8_TOO_LARGE  0x08 // F4 90..BF, or F5..FF
+#define TAG_UTF8_SURROGATE  0x10 // ED A0..BF
+#define TAG_UTF8_OVERLONG_2 0x20 // C0..C1
+#define TAG_UTF8_OVERLONG_4 0x40 // F0 80..8F, and F5..FF 80..8F
+#define TAG_UTF8_TWO_CONTS  0x80 // Two continuations
+#define TAG_UTF8_CARRY (TAG_UTF8_TOO_SHORT | TAG_UTF8_TOO_LONG \
+  | TAG_UTF8_TWO_CONTS)
+
+// The bytes of v, shifted along by n bytes, with the last n of prev first
+#define TAG_UTF8_PREV(v, prev, n) _mm256_alignr_epi8 ((v), \
+  _mm256_permute2x128_si256 ((prev), (v), 0x21), 16 - (n))
+
+__attribute__((target ("avx2")))
+static inline __m256i tag_utf8_errors_avx2 (__m256i v, __m256i prev)
+  {
+  const __m256i nibble = _mm256_set1_epi8 (0x0F);
+  const __m256i byte_1_high = _mm256_setr_epi8 (
+    TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG, 
+    TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG, 
+    TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG,
+    TAG_UTF8_TWO_CONTS, TAG_UTF8_TWO_CONTS, TAG_UTF8_TWO_CONTS, 
+    TAG_UTF8_TWO_CONTS,
+    TAG_UTF8_TOO_SHORT | TAG_UTF8_OVERLONG_2,
+    TAG_UTF8_TOO_SHORT,
+    TAG_UTF8_TOO_SHORT | TAG_UTF8_OVERLONG_3 | TAG_UTF8_SURROGATE,
+    TAG_UTF8_TOO_SHORT | TAG_UTF8_TOO_LARGE | TAG_UTF8_OVERLONG_4,
+    TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG, 
+    TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG, 
+    TAG_UTF8_TOO_LONG, TAG_UTF8_TOO_LONG,
+    TAG_UTF8_TWO_CONTS, TAG_UTF8_TWO_CONTS, TAG_UTF8_TWO_CONTS, 
+    TAG_UTF8_TWO_CONTS,
+    TAG_UTF8_TOO_SHORT | TAG_UTF8_OVERLONG_2,
+    TAG_UTF8_TOO_SHORT,
+    TAG_UTF8_TOO_SHORT | TAG_UTF8_OVERLONG_3 | TAG_UTF8_SURROGATE,
+    TAG_UTF8_TOO_SHORT | TAG_UTF8_TOO_LARGE | TAG_UTF8_OVERLONG_4);
+  const char large = TAG_UTF8_CARRY | TAG_UTF8_TOO_LARGE | TAG_UTF8_OVERLONG_4;
+  const __m256i byte_1_low = _mm256_setr_epi8 (
+    TAG_UTF8_CARRY | TAG_UTF8_OVERLONG_3 | TAG_UTF8_OVERLONG_2 
+      | TAG_UTF8_OVERLONG_4,
+    TAG_UTF8_CARRY | TAG_UTF8_OVERLONG_2,
+    TAG_UTF8_CARRY, TAG_UTF8_CARRY,
+    TAG_UTF8_CARRY | TAG_UTF8_TOO_LARGE,
+    large, large, large, large, large, large, large, large,
+    large | TAG_UTF8_SURROGATE, large, large,
+    TAG_UTF8_CARRY | TAG_UTF8_OVERLONG_3 | TAG_UTF8_OVERLONG_2 
+      | TAG_UTF8_OVERLONG_4,
+    TAG_UTF8_CARRY | TAG_UTF8_OVERLONG_2,
+    TAG_UTF8_CARRY, TAG_UTF8_CARRY,
+    TAG_UTF8_CARRY | TAG_UTF8_TOO_LARGE,
+    large, large, large, large, large, large, large, large,
+    large | TAG_UTF8_SURROGATE, large, large);
+  const char cont = TAG_UTF8_TOO_LONG | TAG_UTF8_OVERLONG_2 
+    | TAG_UTF8_TWO_CONTS;
+  const __m256i byte_2_high = _mm256_setr_epi8 (
+    TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, 
+    TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, 
+    TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT,
+    cont | TAG_UTF8_OVERLONG_3 | TAG_UTF8_OVERLONG_4,
+    cont | TAG_UTF8_OVERLONG_3 | TAG_UTF8_TOO_LARGE,
+    cont | TAG_UTF8_SURROGATE | TAG_UTF8_TOO_LARGE,
+    cont | TAG_UTF8_SURROGATE | TAG_UTF8_TOO_LARGE,
+    TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, 
+    TAG_UTF8_TOO_SHORT,
+    TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, 
+    TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, 
+    TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT,
+    cont | TAG_UTF8_OVERLONG_3 | TAG_UTF8_OVERLONG_4,
+    cont | TAG_UTF8_OVERLONG_3 | TAG_UTF8_TOO_LARGE,
+    cont | TAG_UTF8_SURROGATE | TAG_UTF8_TOO_LARGE,
+    cont | TAG_UTF8_SURROGATE | TAG_UTF8_TOO_LARGE,
+    TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, TAG_UTF8_TOO_SHORT, 
+    TAG_UTF8_TOO_SHORT);
+
+  __m256i prev1 = TAG_UTF8_PREV (v, prev, 1);
+  __m256i special = _mm256_and_si256 (_mm256_and_si256 (
+    _mm256_shuffle_epi8 (byte_1_high, 
+      _mm256_and_si256 (_mm256_srli_epi16 (prev1, 4), nibble)),
+    _mm256_shuffle_epi8 (byte_1_low, _mm256_and_si256 (prev1, nibble))),
+    _mm256_shuffle_epi8 (byte_2_high, 
+      _mm256_and_si256 (_mm256_srli_epi16 (v, 4), nibble)));
+
+  // Third and fourth bytes must be continuations, and nothing else
+  __m256i third = _mm256_subs_epu8 (TAG_UTF8_PREV (v, prev, 2), 
+    _mm256_set1_epi8 ((char)(0xE0 - 0x80)));
+  __m256i fourth = _mm256_subs_epu8 (TAG_UTF8_PREV (v, prev, 3), 
+    _mm256_set1_epi8 ((char)(0xF0 - 0x80)));
+  __m256i must_be_cont = _mm256_and_si256 (_mm256_or_si256 (third, fourth),
+    _mm256_set1_epi8 ((char)0x80));
+  return _mm256_xor_si256 (must_be_cont, special);
+  }
+
+__attribute__((target ("avx2")))
+static BOOL tag_utf8_valid_avx2 (const BYTE *s, int n)
+  {
+  __m256i prev = _mm256_setzero_si256 ();
+  __m256i errors = _mm256_setzero_si256 ();
+  int i;
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *)(s + i));
+    // ASCII is only wrong if it breaks off a character
+    if (!_mm256_movemask_epi8 (_mm256_or_si256 (v, prev)))
+      continue;
+    errors = _mm256_or_si256 (errors, tag_utf8_errors_avx2 (v, prev));
+    prev = v;
+    }
+  if (!_mm256_testz_si256 (errors, errors)) return FALSE;
+  if (!_mm256_movemask_epi8 (prev))
+    return tag_utf8_check_run (s, n, &i, n);
+  // The rest is padded with zeros, which end any unfinished character, 
+  //  and so make it an error
+  BYTE last[32];
+  memset (last, 0, sizeof (last));
+  memcpy (last, s + i, n - i);
+  errors = _mm256_or_si256 (errors, tag_utf8_errors_avx2 (
+    _mm256_loadu_si256 ((const __m256i *)last), prev));
+  return _mm256_testz_si256 (errors, errors);
+  }
+
+#endif // TAG_X86_SIMD
+
+static int tag_utf16_len_none (const BYTE *s, int n, BOOL big_endian, 
+    int *len)
+  {
+  (void)s; (void)n; (void)big_endian; (void)len;
+  return 0;
+  }
+
+static int tag_utf16_write_none (const BYTE *s, int n, BOOL big_endian, 
+    UTF8 **out)
+  {
+  (void)s; (void)n; (void)big_endian; (void)out;
+  return 0;
+  }
+
+static int tag_latin1_len_none (const BYTE *s, int n, int *len)
+  {
+  (void)s; (void)n; (void)len;
+  return 0;
+  }
+
+static int tag_latin1_write_none (const BYTE *s, int n, UTF8 **out)
+  {
+  (void)s; (void)n; (void)out;
+  return 0;
+  }
+
+static BOOL tag_utf8_valid_none (const BYTE *s, int n)
+  {
+  int i = 0;
+  return tag_utf8_check_run (s, n, &i, n);
+  }
+
+/*
+ * Work out the widest vector code that the CPU can run. Without any, the
+ * vector functions do nothing, and the scalar code does all the work.
+ */
+static const TagTextVector *tag_text_vector_select (void)
+  {
+#ifdef TAG_X86_SIMD
+  static const TagTextVector avx2 = 
+    { tag_utf16_len_avx2, tag_utf16_write_avx2, 
+      tag_latin1_len_avx2, tag_latin1_write_avx2, tag_utf8_valid_avx2 };
+  static const TagTextVector sse2 = 
+    { tag_utf16_len_sse2, tag_utf16_write_sse2, 
+      tag_latin1_len_sse2, tag_latin1_write_sse2, tag_utf8_valid_sse2 };
+  if (__builtin_cpu_supports ("avx2")) return &avx2;
+  if (__builtin_cpu_supports ("sse2")) return &sse2;
+#endif
+  static const TagTextVector none = 
+    { tag_utf16_len_none, tag_utf16_write_none, 
+      tag_latin1_len_none, tag_latin1_write_none, tag_utf8_valid_none };
+  return &none;
+  }
+
+/*
+ * The vector code is worked out once, when the program starts, rather 
+ * than for every conversion
+ */
+static const TagTextVector *tag_vector;
+
+__attribute__((constructor))
+static void tag_text_vector_init (void)
+  {
+  tag_vector = tag_text_vector_select ();
+  }
+
+static const TagTextVector *tag_text_vector (void)
+  {
+  return tag_vector ? tag_vector : tag_text_vector_select ();
+  }
+
+/*
+ * Convert len bytes of UTF-16 to a new zero-terminated UTF-8 string in
+ * the arena, of exactly the right size. With a BOM, the text is in the
+ * byte order that the BOM says; without one, ID3v2 says that it is 
+ * big-endian. Conversion stops at the first zero unit. Returns NULL if 
+ * we run out of memory.
+ */
+static char *tag_convert_utf16_to_utf8 (TagArena *arena, BOOL has_bom, 
+    const BYTE *s, int len)
+{
+  const TagTextVector *vec = tag_text_vector ();
+  BOOL big_endian = TRUE;
+  int n = len / 2;
+
+  if (has_bom && n > 0)
+    {
+    if (s[0] == 0xFF && s[1] == 0xFE)
+      {
+      big_endian = FALSE;
+      s += 2; n--;
+      }
+    else if (s[0] == 0xFE && s[1] == 0xFF)
+      {
+      s += 2; n--;
+      }
+    else
+      big_endian = FALSE; // No BOM after all -- guess at Windows order
+    }
+
+  // The first pass. A terminator is converted along with the text, so a
+  //  high surrogate just before it is unpaired, rather than truncated. 
+  int utf8_len = 0;
+  BOOL terminated = FALSE;
+  int i = 0, limit = 0;
+  while (i < n && !terminated)
+    {
+    int done = vec->utf16_len (s + 2 * i, n - i, big_endian, &utf8_len);
+    i += done;
+    if (i == n) break;
+    if (done || !limit) limit = TAG_UTF16_CHUNK;
+    else if (limit < n) limit *= 2;
+    int count = tag_utf16_len_chunk (s + 2 * i, n - i, limit, big_endian, 
+      &utf8_len, &terminated);
+    if (count < 0)
+      {
+      const char *error = "Unicode error";
+      return tag_strndup (arena, error, strlen (error));
+      }
+    i += count;
+    }
+  n = i;
+  if (!terminated) utf8_len++;
+
+  // The vector code may need some room to spare, which is given back 
+  //  afterwards
+  UTF8 *target = (UTF8 *) tag_arena_alloc (arena, 
+    utf8_len + TAG_VECTOR_SLACK);   
+  if (!target) return NULL;
+  UTF8 *t = target;
+  UTF8 *end = target + utf8_len;
+
+  i = 0;
+  limit = 0;
+  while (i < n)
+    {
+    int done = vec->utf16_write (s + 2 * i, n - i, big_endian, &t);
+    i += done;
+    if (i == n) break;
+    if (done || !limit) limit = TAG_UTF16_CHUNK;
+    else if (limit < n) limit *= 2;
+    int chunk_len;
+    i += tag_utf16_convert_chunk (s + 2 * i, n - i, limit, big_endian, t, 
+      end, &chunk_len);
+    t += chunk_len;
+    }
+  if (!terminated) *t = 0;
+
+  tag_arena_shrink (arena, target, utf8_len + TAG_VECTOR_SLACK, utf8_len);
+  return (char*) target;
+}
+
+/*
+ * Convert len bytes of ISO-8859-1 to a new zero-terminated UTF-8 string
+ * in the arena, of exactly the right size, stopping at the first zero.
+ * As with UTF-16, there is a pass to measure the UTF-8 and a pass to 
+ * write it, and both take runs of ASCII a vector at a time. Returns NULL
+ * if we run out of memory.
+ */
+static unsigned char *tag_convert_iso8859_to_utf8 
+  (TagArena *arena, const unsigned char *s, int len)
+{
+  const TagTextVector *vec = tag_text_vector ();
+
+  // The vector code only stops at a zero, or near the end
+  int utf8_len = 0;
+  int n = vec->latin1_len (s, len, &utf8_len);
+  while (n < len && s[n])
+    utf8_len += 1 + (s[n++] >> 7);
+
+  unsigned char *buff = (unsigned char *) tag_arena_alloc (arena, 
+    utf8_len + 1 + TAG_VECTOR_SLACK);
+  if (!buff) return NULL;
+  UTF8 *out = buff;
+  
+  int i = 0;
+  while (i < n)
+    {
+    i += vec->latin1_write (s + i, n - i, &out);
+    int end = i + TAG_UTF16_CHUNK < n ? i + TAG_UTF16_CHUNK : n;
+    for (; i < end; i++)
+      {
+      if (s[i] < 0x80) 
+        *out++ = s[i];
+      else 
+        { 
+        *out++ = 0xC0 | (s[i] >> 6); 
+        *out++ = 0x80 | (s[i] & 0x3F); 
+        }
+      }
+    }
+  *out = 0;
+
+  tag_arena_shrink (arena, buff, utf8_len + 1 + TAG_VECTOR_SLACK, 
+    utf8_len + 1);
+  return buff;
+}
+
+/*
+ * Copy the n bytes of invalid UTF-8 at s to a new zero-terminated string
+ * in the arena, replacing each byte that doesn't start a valid 
+ * character with U+FFFD. Returns NULL if we run out of memory.
+ */
+static unsigned char *tag_utf8_replace_invalid (TagArena *arena, 
+    const BYTE *s, int n)
+  {
+  int i = 0, utf8_len = 0;
+  while (i < n)
+    {
+    int len = tag_utf8_char_len (s + i, n - i);
+    utf8_len += len ? len : 3;
+    i += len ? len : 1;
+    }
+
+  unsigned char *buff = (unsigned char *) tag_arena_alloc (arena, 
+    utf8_len + 1);
+  if (!buff) return NULL;
+  unsigned char *out = buff;
+  i = 0;
+  while (i < n)
+    {
+    int len = tag_utf8_char_len (s + i, n - i);
+    if (len)
+      {
+      memcpy (out, s + i, len);
+      out += len;
+      i += len;
+      }
+    else
+      {
+      *out++ = 0xEF; *out++ = 0xBF; *out++ = 0xBD;
+      i++;
+      }
+    }
+  *out = 0;
+  return buff;
+  }
+
+/**********************************************************************
+  TAG NAMES
+*********************************************************************/
+
+/*
+ * Each format has its own names for the common tags, and some formats
+ * have more than one. A tag's naming convention says which kind of file
+ * we'd expect to find it in. The conventions are in order of preference,
+ * for when a file has names from more than one.
+ */
+typedef enum
+  {
+  TAG_NAMING_NONE = 0,
+  TAG_NAMING_ID3V23,  // Four-character ID3v2.3 and v2.4 frame IDs
+  TAG_NAMING_ID3V22,  // Three-character ID3v2.2 frame IDs
+  TAG_NAMING_VORBIS,  // Vorbis comments in FLAC and Ogg files
+  TAG_NAMING_MP4      // MP4 ilst item atoms
+  } TagNaming;
+
+/*
+ * ID3 frame IDs and MP4 atom types are three or four characters, so they
+ * can be packed into a 32-bit integer, and compared and switched on as
+ * one. Tag names are matched regardless of case, so they are packed in 
+ * upper case; a three-character name has a zero in the low byte. The
+ * longer Vorbis names are packed by their first four characters.
+ */
+typedef unsigned int TagKey;
+
+#define TAG_KEY(a, b, c, d) (((TagKey)(BYTE)(a) << 24) \
+  | ((TagKey)(BYTE)(b) << 16) | ((TagKey)(BYTE)(c) << 8) | (TagKey)(BYTE)(d))
+
+// Longest name that can be the name of a common tag, and then some
+#define TAG_MAX_NAME 16
+
+/*
+ * A tag name, as it is in the file, with its key, and the common tags 
+ * that it is a name of, if any -- see tag_get_common(). 
+ */
+typedef struct
+  {
+  const char *id;      // Not necessarily zero-terminated
+  int len;
+  TagKey key;
+  unsigned int common; // TAG_COMMON_BIT of each common tag that it names
+  TagNaming naming;    // The convention that the name belongs to
+  BOOL preferred;      // It's the convention's first choice for these tags
+  } TagName;
+
+#define TAG_C(id) TAG_COMMON_BIT (TAG_COMMON_##id)
+
+// TAG_COMMON_YEAR and TAG_COMMON_DATE are the same tag
+#define TAG_C_YEAR (TAG_C (YEAR) | TAG_C (DATE))
+
+#define TAG_NAME_CLASS(k, c, nc, pref) \
+  case k: n->common = (c); n->naming = TAG_NAMING_##nc; \
+    n->preferred = (pref); break;
+
+/*
+ * Classify a name of up to four characters, by its key. The compiler 
+ * makes the switch into a table or a binary search.
+ */
+static void tag_classify_short_name (TagName *n)
+  {
+  switch (n->key)
+    {
+    TAG_NAME_CLASS (TAG_KEY ('T','I','T','2'), TAG_C (TITLE), ID3V23, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','P','E','1'), TAG_C (ARTIST), ID3V23, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','P','E','2'), TAG_C (ALBUM_ARTIST), ID3V23, 
+      TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','C','O','N'), TAG_C (GENRE), ID3V23, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','A','L','B'), TAG_C (ALBUM), ID3V23, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','C','O','M'), TAG_C (COMPOSER), ID3V23, 
+      TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','Y','E','R'), TAG_C_YEAR, ID3V23, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','R','C','K'), TAG_C (TRACK), ID3V23, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('C','O','M','M'), TAG_C (COMMENT), ID3V23, TRUE)
+
+    TAG_NAME_CLASS (TAG_KEY ('T','T','2',0), TAG_C (TITLE), ID3V22, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','P','1',0), TAG_C (ARTIST), ID3V22, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','P','2',0), TAG_C (ALBUM_ARTIST), ID3V22, 
+      TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','C','O',0), TAG_C (GENRE), ID3V22, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','A','L',0), TAG_C (ALBUM), ID3V22, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','C','M',0), TAG_C (COMPOSER), ID3V22, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','Y','E',0), TAG_C_YEAR, ID3V22, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','R','K',0), TAG_C (TRACK), ID3V22, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('C','O','M',0), TAG_C (COMMENT), ID3V22, TRUE)
+
+    TAG_NAME_CLASS (TAG_KEY ('D','A','T','E'), TAG_C_YEAR, VORBIS, TRUE)
+
+    // MP4 names are without the 0xA9 that most of them start with
+    TAG_NAME_CLASS (TAG_KEY ('N','A','M',0), TAG_C (TITLE), MP4, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('A','R','T',0), TAG_C (ARTIST), MP4, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('A','A','R','T'), TAG_C (ALBUM_ARTIST), MP4, 
+      TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('G','E','N',0), TAG_C (GENRE), MP4, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('G','N','R','E'), TAG_C (GENRE), MP4, FALSE)
+    TAG_NAME_CLASS (TAG_KEY ('A','L','B',0), TAG_C (ALBUM), MP4, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('W','R','T',0), TAG_C (COMPOSER), MP4, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('D','A','Y',0), TAG_C_YEAR, MP4, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('T','R','K','N'), TAG_C (TRACK), MP4, TRUE)
+    TAG_NAME_CLASS (TAG_KEY ('C','M','T',0), TAG_C (COMMENT), MP4, TRUE)
+    }
+  }
+
+/*
+ * Classify a longer (Vorbis) name. The key narrows it down to one or two
+ * candidates, which folded, the name in upper case, must then match.
+ */
+static void tag_classify_long_name (TagName *n, const char *folded)
+  {
+  static const struct 
+    {
+    const char *name;
+    unsigned int common;
+    BOOL preferred;
+    } names[] =
+    {
+    { "TITLE", TAG_C (TITLE), TRUE },
+    { "ARTIST", TAG_C (ARTIST), TRUE },
+    { "PERFORMER", TAG_C (ARTIST), FALSE },
+    { "ALBUMARTIST", TAG_C (ALBUM_ARTIST), TRUE },
+    { "GENRE", TAG_C (GENRE), TRUE },
+    { "ALBUM", TAG_C (ALBUM), TRUE },
+    { "COMPOSER", TAG_C (COMPOSER), TRUE },
+    { "TRACKNUMBER", TAG_C (TRACK), TRUE },
+    { "DESCRIPTION", TAG_C (COMMENT), TRUE },
+    { "COMMENT", TAG_C (COMMENT), FALSE },
+    };
+  int i;
+  switch (n->key)
+    {
+    case TAG_KEY ('T','I','T','L'): i = 0; break;
+    case TAG_KEY ('A','R','T','I'): i = 1; break;
+    case TAG_KEY ('P','E','R','F'): i = 2; break;
+    case TAG_KEY ('A','L','B','U'): i = n->len == 5 ? 5 : 3; break;
+    case TAG_KEY ('G','E','N','R'): i = 4; break;
+    case TAG_KEY ('C','O','M','P'): i = 6; break;
+    case TAG_KEY ('T','R','A','C'): i = 7; break;
+    case TAG_KEY ('D','E','S','C'): i = 8; break;
+    case TAG_KEY ('C','O','M','M'): i = 9; break;
+    default: return;
+    }
+  if ((int)strlen (names[i].name) != n->len 
+      || memcmp (names[i].name, folded, n->len) != 0) 
+    return;
+  n->common = names[i].common;
+  n->naming = TAG_NAMING_VORBIS;
+  n->preferred = names[i].preferred;
+  }
 
-  if (version >= 3)
+/*
+ * Make a TagName from the first len characters of id. The name is 
+ * folded to upper case in one pass, which makes its key; after that, 
+ * everything we need to know about it is integer comparisons.
+ */
+static void tag_name_init (TagName *n, const char *id, int len)
   {
-    // v2.3 has 4 byte ID and 4 byte size, 2 byte flags. Total
-    //  frame header size is 10 
-    header_len = 10;
+  char folded[TAG_MAX_NAME];
+  int i;
 
-    if (read (f, frameId, 4) != 4) return TAG_TRUNCATED; 
+  n->id = id;
+  n->len = len;
+  n->key = 0;
+  n->common = 0;
+  n->naming = TAG_NAMING_NONE;
+  n->preferred = FALSE;
 
-    if (frameId[0] == 0)
+  for (i = 0; i < len && i < TAG_MAX_NAME; i++)
     {
-      if (tag_debug)
-        printf ("Got a null frame ID in v2.3 header\n");
+    char c = id[i];
+    if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+    folded[i] = c;
+    if (i < 4) n->key |= (TagKey)(BYTE)c << (24 - 8 * i);
+    }
+
+  if (len <= 4)
+    tag_classify_short_name (n);
+  else if (len <= TAG_MAX_NAME)
+    tag_classify_long_name (n, folded);
+  }
+
+/*
+ * Where the name comes in order of preference, among the names of the 
+ * same common tag -- lower is better.
+ */
+static int tag_name_rank (const TagName *n)
+  {
+  return n->naming * 2 + !n->preferred;
+  }
+
+/*
+ * Does name match id, regardless of case? key is id's key, which 
+ * settles it for most names.
+ */
+static BOOL tag_name_matches (const TagName *n, TagKey key, const char *id)
+  {
+  return n->key == key && strncasecmp (n->id, id, n->len) == 0 
+    && id[n->len] == 0;
+  }
+
+/**********************************************************************
+  TAG CONSTRUCTION
+*********************************************************************/
+
+/*
+ * Add an empty Tag to the end of a TagData's tags. The tag array grows 
+ * by doubling; the old array is left in the arena, to be reclaimed with 
+ * everything else. That won't do for a pooled TagData, whose arena is
+ * the pool's, and is never reclaimed: its array grows on the heap 
+ * instead, and tag_finish_tags() moves it to the arena when parsing is
+ * done. Returns NULL if we run out of memory.
+ */
+static Tag *tag_append (TagData *tag_data)
+{
+  if (tag_data->tag_count == tag_data->tag_capacity)
+  {
+    int capacity = tag_data->tag_capacity ? tag_data->tag_capacity * 2 : 16;
+    Tag *tags;
+    if (tag_data->pool)
+    {
+      tags = (Tag *)realloc (tag_data->tags, capacity * sizeof (Tag));
+      if (!tags) return NULL;
+    }
+    else
+    {
+      tags = (Tag *)tag_arena_alloc (tag_data->arena, 
+        capacity * sizeof (Tag));
+      if (!tags) return NULL;
+      if (tag_data->tag_count)
+        memcpy (tags, tag_data->tags, tag_data->tag_count * sizeof (Tag));
+    }
+    tag_data->tags = tags;
+    tag_data->tag_capacity = capacity;
+  }
+
+  Tag *tag = &tag_data->tags[tag_data->tag_count++];
+  memset (tag, 0, sizeof (Tag)); 
+  return tag;
+}
+
+/*
+ * Move a pooled TagData's tags from the heap, where tag_append() grew 
+ * them, to a block of just the right size in the arena
+ */
+static TagResult tag_finish_tags (TagData *tag_data)
+{
+  if (!tag_data->pool || !tag_data->tags) return TAG_OK;
+  Tag *tags = NULL;
+  if (tag_data->tag_count)
+  {
+    tags = (Tag *)tag_arena_alloc (tag_data->arena, 
+      tag_data->tag_count * sizeof (Tag));
+    if (tags)
+      memcpy (tags, tag_data->tags, tag_data->tag_count * sizeof (Tag));
+  }
+  free (tag_data->tags);
+  tag_data->tags = tags;
+  tag_data->tag_capacity = tag_data->tag_count;
+  if (tags || !tag_data->tag_count) return TAG_OK;
+  tag_data->tag_count = 0;
+  int c;
+  for (c = 0; c < TAG_COMMON_COUNT; c++)
+    tag_data->common[c] = -1;
+  return TAG_OUTOFMEMORY;
+}
+
+/*
+ * If the new tag at index is one of the names of a common tag, and it is
+ * a better name than the one we already have (if any), make it that 
+ * common tag. Where a file has more than one tag with the best name, the
+ * first one wins. So this gives the same result as looking up each name 
+ * in turn, but we only have to do it once.
+ */
+static void tag_fill_common_slots (TagData *tag_data, int index, 
+    const TagName *name)
+  {
+  int rank = tag_name_rank (name);
+  int c;
+  for (c = 0; c < TAG_COMMON_COUNT; c++)
+    {
+    if (!(name->common & TAG_COMMON_BIT (c))) continue;
+    if (tag_data->common[c] < 0 || rank < tag_data->common_rank[c])
+      {
+      tag_data->common[c] = index;
+      tag_data->common_rank[c] = rank;
+      }
+    }
+  }
+
+/*
+ * Add a text Tag with the given name to a TagData. The data must be 
+ * zero-terminated UTF-8, allocated from the TagData's arena. Returns NULL
+ * if we run out of memory, or if data is NULL.
+ */
+static Tag *tag_new_tag (TagData *tag_data, const TagName *name,
+    unsigned char *data)
+{
+  if (!data) return NULL;
+  char *id;
+  if (tag_data->pool)
+    {
+    // If the value is already pooled, we can give back the memory that 
+    //  it was just decoded into, as nothing has been allocated since
+    int len = strlen ((char *)data);
+    unsigned char *pooled = (unsigned char *)tag_pool_intern 
+      (tag_data->pool, (char *)data, len, TRUE);
+    if (!pooled) return NULL;
+    if (pooled != data) 
+      tag_arena_shrink (tag_data->arena, data, len + 1, 0);
+    data = pooled;
+    id = (char *)tag_pool_intern (tag_data->pool, name->id, name->len, 
+      FALSE);
+    }
+  else
+    id = tag_strndup (tag_data->arena, name->id, name->len);
+  if (!id) return NULL;
+  Tag *tag = tag_append (tag_data);
+  if (!tag) return NULL;
+  tag->frameId = id;
+  tag->type = TAG_TYPE_TEXT;
+  tag->data = data;
+  tag->data_len = strlen ((char *)data);
+  tag->arena = tag_data->arena;
+  tag->key = name->key;
+  tag_fill_common_slots (tag_data, tag_data->tag_count - 1, name);
+  return tag;
+}
+
+/*
+ * Add a text Tag from len bytes that should be UTF-8, stopping at
+ * the first zero, if there is one. If view is TRUE, the tag's data points 
+ * straight at the text, which must outlive the tag; otherwise the text
+ * is copied. Text for a pool is always copied. The text is checked, and 
+ * perhaps repaired, as tag_utf8_repair says.
+ */
+static Tag *tag_new_utf8_tag (TagData *tag_data, const TagName *name, 
+    const BYTE *text, int len, BOOL view)
+{
+  const BYTE *end = memchr (text, 0, len);
+  if (end) len = end - text;
+
+  TagUTF8Status status = TAG_UTF8_UNCHECKED;
+  unsigned char *repaired = NULL;
+  if (tag_utf8_repair != TAG_UTF8_TRUST)
+    {
+    if (tag_text_vector ()->utf8_valid (text, len))
+      status = TAG_UTF8_VALID;
+    else if (tag_utf8_repair == TAG_UTF8_REPLACE)
+      {
+      status = TAG_UTF8_REPLACED;
+      repaired = tag_utf8_replace_invalid (tag_data->arena, text, len);
+      if (!repaired) return NULL;
+      }
+    else if (tag_utf8_repair == TAG_UTF8_LATIN1)
+      {
+      status = TAG_UTF8_FROM_LATIN1;
+      repaired = tag_convert_iso8859_to_utf8 (tag_data->arena, text, len);
+      if (!repaired) return NULL;
+      }
+    else
+      status = TAG_UTF8_INVALID;
+    if (tag_debug && status != TAG_UTF8_VALID)
+      printf ("Tag %.*s is not valid UTF-8\n", name->len, name->id);
+    }
+
+  Tag *tag;
+  if (repaired)
+    tag = tag_new_tag (tag_data, name, repaired);
+  else if (!view || tag_data->pool)
+    tag = tag_new_tag (tag_data, name, 
+      (unsigned char *)tag_strndup (tag_data->arena, (const char *)text, 
+      len));
+  else
+    {
+    tag = tag_new_tag (tag_data, name, (unsigned char *)"");
+    if (!tag) return NULL;
+    tag->data = (unsigned char *)text;
+    tag->data_len = len;
+    tag->is_view = TRUE;
+    }
+  if (tag) tag->utf8 = status;
+  return tag;
+}
+
+/**********************************************************************
+  TAG SELECTION 
+*********************************************************************/
+
+/*
+ * The state of a filtered parse -- see tag_get_tags_filtered(). A 
+ * common tag counts as found when we've found its preferred name for the
+ * file's naming convention. We assume that files don't use another 
+ * format's names, which would otherwise take precedence.
+ */
+typedef struct _TagWanted
+  {
+  const TagFilter *filter;
+  TagNaming naming;         // Naming convention of the file being parsed
+  unsigned int common_left; // Common tags not yet found
+  int ids_left;             // Exact IDs not yet found
+  BOOL *id_found;           // Which of the filter's IDs we've found
+  TagKey *id_keys;          // The keys of the filter's IDs
+  BOOL cover_found;         // We have the front cover, if it's wanted
+  } TagWanted;
+
+/*
+ * Is the tag with this name one that the caller wants?
+ */
+static BOOL tag_is_wanted (const TagWanted *w, const TagName *n)
+  {
+  if (!w) return TRUE;
+
+  if (w->filter->common & n->common) return TRUE;
+
+  int i;
+  for (i = 0; i < w->filter->n_ids; i++)
+    if (tag_name_matches (n, w->id_keys[i], w->filter->ids[i])) return TRUE;
+
+  return FALSE;
+  }
+
+/*
+ * Note that we've decoded the tag with this name, which may complete
+ * the set that the caller wants.
+ */
+static void tag_wanted_found (TagWanted *w, const TagName *n)
+  {
+  if (!w) return;
+
+  int i;
+  for (i = 0; i < w->filter->n_ids; i++)
+    {
+    if (!w->id_found[i] 
+        && tag_name_matches (n, w->id_keys[i], w->filter->ids[i]))
+      {
+      w->id_found[i] = TRUE;
+      w->ids_left--;
+      }
+    }
+
+  // Only the first name in this file's naming convention will do 
+  if (n->preferred && n->naming == w->naming)
+    w->common_left &= ~n->common;
+  }
+
+/*
+ * Have we found everything that the caller wants? If so, parsing can 
+ * stop.
+ */
+static BOOL tag_wanted_all_found (const TagWanted *w)
+  {
+  if (!w) return FALSE;
+  return w->ids_left == 0 && w->common_left == 0 
+    && (!w->filter->cover || w->cover_found);
+  }
+
+/*
+ * Does the caller want the cover image? 
+ */
+static BOOL tag_wants_cover (const TagWanted *w)
+  {
+  return !w || (w->filter->cover && !w->cover_found);
+  }
+
+static void tag_set_naming (TagWanted *w, TagNaming naming)
+  {
+  if (w) w->naming = naming;
+  }
+
+
+/**********************************************************************
+  COVER ART 
+*********************************************************************/
+
+/*
+ * Cover images can be megabytes long, and most callers don't want them,
+ * so the parsers don't read them: they just record where the image is,
+ * for tag_read_cover() or tag_copy_cover_to_fd() to fetch later. 
+ * Decoding a picture header only needs the first few hundred bytes of 
+ * the frame or block that holds it.
+ */
+#define TAG_PICTURE_HEAD_SIZE 1024
+
+// Largest buffer we'll use when copying a cover image
+#define TAG_COPY_CHUNK (64 * 1024)
+
+// What a format's picture header says about the image
+typedef struct
+  {
+  const BYTE *mime;  // MIME type -- not zero-terminated
+  int mime_len;
+  int type;          // ID3v2/FLAC picture type; 3 is the front cover
+  int offset;        // Of the image, from the start of the frame or block
+  int len;           // Of the image
+  } TagPicture;
+
+/*
+ * A function that decodes the header of a picture frame or block of 
+ * length len, of which avail bytes are at p. Returns FALSE if the start
+ * of the image isn't within avail bytes, or if the header is defective.
+ */
+typedef BOOL (*TagPictureReader) (const BYTE *p, int avail, int len, 
+   TagPicture *pic);
+
+/*
+ * Record the image described by pic, which is at the specified offset in 
+ * the stream, as the cover, if it is the first front cover. Pictures of
+ * other types are ignored, as they always have been. An in-memory stream
+ * has no file to go back to, so for those the image is a pointer into 
+ * the mapping, or a copy if the caller's buffer won't outlive the TagData.
+ */
+static TagResult tag_set_cover (TagStream *s, TagData *tag_data, 
+    const TagPicture *pic, off_t offset)
+  {
+  if (tag_data->cover_len > 0 || pic->type != 3 || pic->len <= 0) 
+    return TAG_OK;
+
+  if (s->f < 0)
+    {
+    if (offset + pic->len > s->prefix_len) return TAG_TRUNCATED;
+    BYTE *cover;
+    if (s->views)
+      cover = (BYTE *)s->prefix + offset;
+    else
+      {
+      cover = tag_arena_alloc (tag_data->arena, pic->len);
+      if (!cover) return TAG_OUTOFMEMORY;
+      memcpy (cover, s->prefix + offset, pic->len);
+      }
+    tag_data->cover = cover;
+    }
+  else if (!tag_data->cover_file)
+    {
+    tag_data->cover_file = tag_strndup (tag_data->arena, s->file, 
+      strlen (s->file));
+    if (!tag_data->cover_file) return TAG_OUTOFMEMORY;
+    }
+
+  if (tag_debug)
+    printf ("Cover image type %d, %.*s, %d bytes at %lld\n", pic->type,
+      pic->mime_len, pic->mime, pic->len, (long long)offset);
+
+  tag_data->cover_offset = offset;
+  tag_data->cover_len = pic->len;
+  tag_data->cover_type = pic->type;
+  if (s->wanted && pic->type == 3) s->wanted->cover_found = TRUE;
+  int mime_len = pic->mime_len;
+  if (mime_len > (int)sizeof (tag_data->cover_mime) - 1)
+    mime_len = sizeof (tag_data->cover_mime) - 1;
+  memcpy (tag_data->cover_mime, pic->mime, mime_len);
+  tag_data->cover_mime[mime_len] = 0;
+  return TAG_OK;
+  }
+
+/*
+ * Decode the picture frame or block of length len at the current stream 
+ * position using the specified reader, and record its image as the cover 
+ * if we want it. Usually only the start of the frame is read; the stream 
+ * is left at its end.
+ */
+static TagResult tag_read_picture (TagStream *s, int len, 
+    TagPictureReader reader, TagData *tag_data)
+  {
+  off_t start = s->pos;
+  int head_len = len < TAG_PICTURE_HEAD_SIZE ? len : TAG_PICTURE_HEAD_SIZE;
+  const BYTE *head;
+  BOOL copied;
+  TagPicture pic;
+  TagResult ret = TAG_OK;
+
+  int n = tag_stream_fetch (s, head_len, &head, &copied);
+  if (n < 0) return TAG_OUTOFMEMORY;
+  BOOL found = reader (head, n, len, &pic);
+  if (!found && n == head_len && head_len < len)
+    {
+    // Perhaps a very long description -- try again with the whole thing
+    tag_stream_seek (s, start, SEEK_SET);
+    n = tag_stream_fetch (s, len, &head, &copied);
+    if (n < 0) return TAG_OUTOFMEMORY;
+    found = reader (head, n, len, &pic);
+    }
+
+  if (found)
+    ret = tag_set_cover (s, tag_data, &pic, start + pic.offset);
+  else if (n < head_len)
+    ret = TAG_TRUNCATED;
+
+  tag_stream_seek (s, start + len, SEEK_SET);
+  return ret;
+  }
+
+/*
+ * Read count bytes of the cover image, starting offset bytes into it, 
+ * into buff. 
+ */
+static TagResult tag_read_cover_part (const TagData *tag_data, int f, 
+    off_t offset, BYTE *buff, int count)
+  {
+  if (tag_data->cover)
+    {
+    memcpy (buff, tag_data->cover + offset, count);
+    return TAG_OK;
+    }
+
+  while (count > 0)
+    {
+    TAG_STAT_ADD (reads, 1);
+    int r = read (f, buff, count);
+    if (r < 0) return TAG_READERROR;
+    if (r == 0) return TAG_TRUNCATED;
+    TAG_STAT_ADD (bytes_read, r);
+    buff += r;
+    count -= r;
+    }
+  return TAG_OK;
+  }
+
+/*
+ * Open the file that holds the cover image, positioned at the start of 
+ * the image. *f_ret is -1 if the image is already in memory.
+ */
+static TagResult tag_open_cover (const TagData *tag_data, int *f_ret)
+  {
+  *f_ret = -1;
+  if (tag_data->cover_len <= 0) return TAG_NOCOVER;
+  if (tag_data->cover) return TAG_OK;
+
+  TAG_STAT_ADD (opens, 1);
+  int f = open (tag_data->cover_file, O_RDONLY | O_BINARY);
+  if (f < 0) return TAG_READERROR;
+  TAG_STAT_ADD (seeks, 1);
+  if (lseek (f, tag_data->cover_offset, SEEK_SET) 
+      != (off_t)tag_data->cover_offset)
+    {
+    close (f);
+    return TAG_READERROR;
+    }
+  *f_ret = f;
+  return TAG_OK;
+  }
+
+/*
+ * Read the cover image into a buffer, which is allocated here and 
+ * returned in *cover_ret for the caller to free. 
+ */
+TagResult tag_read_cover (const TagData *tag_data, 
+    unsigned char **cover_ret, int *len_ret)
+  {
+  *cover_ret = NULL;
+  *len_ret = 0;
+
+  int f;
+  TagResult ret = tag_open_cover (tag_data, &f);
+  if (ret != TAG_OK) return ret;
+
+  BYTE *cover = malloc (tag_data->cover_len);
+  if (cover)
+    ret = tag_read_cover_part (tag_data, f, 0, cover, tag_data->cover_len);
+  else
+    ret = TAG_OUTOFMEMORY;
+  if (f >= 0) close (f);
+
+  if (ret != TAG_OK)
+    {
+    free (cover);
+    return ret;
+    }
+  *cover_ret = cover;
+  *len_ret = tag_data->cover_len;
+  return TAG_OK;
+  }
+
+/*
+ * Write the whole of a buffer to a file handle, coping with short 
+ * writes.
+ */
+static TagResult tag_write_all (int fd, const BYTE *buff, int count)
+  {
+  while (count > 0)
+    {
+    int w = write (fd, buff, count);
+    if (w <= 0) return TAG_WRITEERROR;
+    buff += w;
+    count -= w;
+    }
+  return TAG_OK;
+  }
+
+#ifdef __linux__
+/*
+ * Copy len bytes, starting at offset in the file f, to fd without 
+ * bringing them into user space. copy_file_range() is tried first, 
+ * because between files on the same filesystem it may not even copy the 
+ * data; sendfile() will work with most other kinds of output. Returns 
+ * TAG_UNSUPFORMAT, before anything has been copied, if the kernel can't
+ * do either with these files. 
+ */
+static TagResult tag_copy_in_kernel (int f, off_t offset, int len, int fd)
+  {
+  BOOL use_sendfile = FALSE;
+  off_t in_offset = offset;
+  int done = 0;
+
+  while (done < len)
+    {
+    TAG_STAT_ADD (reads, 1);
+    ssize_t n = use_sendfile
+      ? sendfile (fd, f, &in_offset, len - done)
+      : copy_file_range (f, &in_offset, fd, NULL, len - done, 0);
+    if (n < 0 && done == 0 && (errno == EXDEV || errno == EINVAL 
+        || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+      {
+      if (use_sendfile) return TAG_UNSUPFORMAT;
+      use_sendfile = TRUE;
+      continue;
+      }
+    if (n < 0) return TAG_WRITEERROR;
+    if (n == 0) return TAG_TRUNCATED;
+    TAG_STAT_ADD (bytes_read, n);
+    done += n;
+    }
+
+  return TAG_OK;
+  }
+#endif
+
+/*
+ * Write the cover image to an open file handle. If the image is still
+ * in the file, the kernel copies it where it can; otherwise it is 
+ * copied in chunks, so the whole image is never in memory.
+ */
+TagResult tag_copy_cover_to_fd (const TagData *tag_data, int fd)
+  {
+  int f;
+  TagResult ret = tag_open_cover (tag_data, &f);
+  if (ret != TAG_OK) return ret;
+
+  if (f < 0)
+    return tag_write_all (fd, tag_data->cover, tag_data->cover_len);
+
+#ifdef __linux__
+  ret = tag_copy_in_kernel (f, tag_data->cover_offset, tag_data->cover_len,
+    fd);
+  if (ret != TAG_UNSUPFORMAT)
+    {
+    close (f);
+    return ret;
+    }
+  ret = TAG_OK;
+#endif
+
+  int chunk = tag_data->cover_len < TAG_COPY_CHUNK 
+    ? tag_data->cover_len : TAG_COPY_CHUNK;
+  BYTE *buff = malloc (chunk);
+  if (!buff) ret = TAG_OUTOFMEMORY;
 
-      *carry_on = 0; // We've hit something we can't process, but
-                   //  previous data should be OK
-      return TAG_OK;
+  off_t done = 0;
+  while (ret == TAG_OK && done < tag_data->cover_len)
+    {
+    int count = tag_data->cover_len - done;
+    if (count > chunk) count = chunk;
+    ret = tag_read_cover_part (tag_data, f, done, buff, count);
+    if (ret == TAG_OK) ret = tag_write_all (fd, buff, count);
+    done += count;
     }
 
+  free (buff);
+  close (f);
+  return ret;
+  }
+
+
+/**********************************************************************
+  MP3/ID3v2 SUPPORT
+*********************************************************************/
+
+/*
+ * Decode an ID3v2 frame header at buff, which is 10 bytes long for v2.3 
+ * and later, or 6 bytes for v2.2. Version is the ID3v2 major version, 
+ * i.e for ID3v2.3 it is 3. The frame ID is written to frameId, which must
+ * have room for five characters. Returns FALSE if there is no frame 
+ * here, which usually means we've reached the padding at the end of the
+ * tag.
+ */
+static BOOL tag_read_frame_header (const BYTE *buff, int version, 
+   char *frameId, int *frame_len)
+{
+  unsigned char b1, b2, b3, b4; 
+
+  memset (frameId, 0, 5);
+
+  if (buff[0] == 0)
+  {
     if (tag_debug)
-      printf ("Found frame of type %s\n", frameId);
+      printf ("Got a null frame ID in frame header\n");
+    return FALSE;
+  }
+
+  if (version >= 3)
+  {
+    // v2.3 has 4 byte ID and 4 byte size, 2 byte flags. Total
+    //  frame header size is 10 
+    memcpy (frameId, buff, 4);
 
-    if (read (f, buff, 6) != 6) return TAG_TRUNCATED; 
-    b1 = buff[0];
-    b2 = buff[1];
-    b3 = buff[2];
-    b4 = buff[3];
+    b1 = buff[4];
+    b2 = buff[5];
+    b3 = buff[6];
+    b4 = buff[7];
 
     // It seems the 2.4 and above use syncsafe lengths in both
     //  the header and the fields, while earlier versions use
@@ -238,88 +2663,73 @@ static TagResult tag_read_frame (int f, int version, int *carry_on,
       {
       // Is this (use of 7bit fields) all we really need to do
       //  to support sync-safe integers
-      frame_len = (128 * 128 * 128) * b1 + 
+      *frame_len = (128 * 128 * 128) * b1 + 
         (128 * 128) * b2 + 
         (128) * b3 + 
          b4;
       }
     else
       {
-      frame_len = (256 * 256 * 256) * b1 + 
+      *frame_len = (256 * 256 * 256) * b1 + 
         (256 * 256) * b2 + 
         (256) * b3 + 
         b4;
       }
-  }
-  else
-  {
-    // v2.2 has 3 byte ID and 3 byte size, no flags. Total
-    //  frame header size is 6
-    header_len = 6;
-
-    if (read (f, frameId, 3) != 3) return TAG_TRUNCATED; 
-
-    if (frameId[0] == 0)
-    {
-      if (tag_debug)
-        printf ("Got a null frame ID in v2.2 header\n");
-
-      *carry_on = 0; // We've hit something we can't process, but
-                   //  previous data should be OK
-      return TAG_OK;
-    }
-
-    if (tag_debug)
-      printf ("Found frame of type %s\n", frameId);
+  }
+  else
+  {
+    // v2.2 has 3 byte ID and 3 byte size, no flags. Total
+    //  frame header size is 6
+    memcpy (frameId, buff, 3);
 
-    if (read (f, buff, 3) != 3) return TAG_TRUNCATED; 
-    b2 = buff[0];
-    b3 = buff[1];
-    b4 = buff[2];
+    b2 = buff[3];
+    b3 = buff[4];
+    b4 = buff[5];
 
-    frame_len = (256 * 256) * b2 + 
+    *frame_len = (256 * 256) * b2 + 
       (256) * b3 + 
       b4;
   }
 
   if (tag_debug)
-    printf ("Frame length = %d\n", frame_len);
+    printf ("Found frame of type %s, length %d\n", frameId, *frame_len);
 
-  if (frame_len < 1)
-    return TAG_TRUNCATED; // Out-of-spec frame
+  return TRUE;
+}
 
-  // Ugh... easytag writes UTF-8 tags without the terminating zero, in
-  // defiance of the spec. So we need to allocate one byte bigger and
-  // null it. :/
-  unsigned char* bigbuff = (unsigned char *) malloc (frame_len + 1); 
-  if (!bigbuff) return TAG_OUTOFMEMORY;
-  memset (bigbuff, 0, frame_len + 1); 
+/*
+ * Decode the body of a text or comment frame, of length frame_len. If a 
+ * tag is decoded, it is added to tag_data, and also returned in *tag_ret.
+ * UTF-8 text may be returned as a view of bigbuff if views is TRUE. 
+ * Returns TAG_OUTOFMEMORY if the tag can't be added.
+ */
+static TagResult tag_read_frame (TagData *tag_data, const TagName *name, 
+   const BYTE *bigbuff, int frame_len, BOOL views, Tag **tag_ret)
+{
+  TagArena *arena = tag_data->arena;
+  *tag_ret = NULL;
 
-  if (read (f, bigbuff, frame_len) != frame_len)
-  {
-    free (bigbuff); 
-    return TAG_TRUNCATED;
-  }
+  // The frame body is not zero-terminated (and easytag writes UTF-8 tags 
+  // without the terminating zero, in defiance of the spec), so all the 
+  // decoding below has to be bounded by frame_len
 
-  *total_bytes += frame_len + header_len;
-    
-  if (frameId[0] == 'T')
+  if (name->id[0] == 'T')
   {
     // This is a text frame
     int encoding = bigbuff[0];
     char *text = NULL; // This is where decoded text will end up
   
-    char *text_start = (char *)bigbuff;
+    const char *text_start = (const char *)bigbuff;
 
     if (encoding == 0)
     {
       // ISO-8859-1 string, starts after this byte
-      text_start = (char *)bigbuff + 1;
+      text_start = (const char *)bigbuff + 1;
       if (tag_debug)
         printf ("Text frame is ISO-8859-1\n");
 
-      text = (char *)tag_convert_iso8859_to_utf8 ((const unsigned char *)
-         text_start, frame_len - 1);
+      text = (char *)tag_convert_iso8859_to_utf8 (arena, 
+        (const unsigned char *)text_start, frame_len - 1);
     }
     else if (encoding == 1)
     {
@@ -327,8 +2737,8 @@ static TagResult tag_read_frame (int f, int version, int *carry_on,
       if (tag_debug)
         printf ("Text frame is UTF-16 with BOM\n");
 
-      text_start = (char *)bigbuff + 1;
-      text = tag_convert_utf16_to_utf8 (1, (const UTF16 *)text_start, 
+      text_start = (const char *)bigbuff + 1;
+      text = tag_convert_utf16_to_utf8 (arena, TRUE, (const BYTE *)text_start, 
         frame_len - 1); 
     }
     else if (encoding == 2)
@@ -337,8 +2747,8 @@ static TagResult tag_read_frame (int f, int version, int *carry_on,
       if (tag_debug)
         printf ("Text frame is UTF-16E without BOM\n");
 
-      text_start = (char *)bigbuff + 1;
-      text = tag_convert_utf16_to_utf8 (0, (const UTF16 *)text_start, 
+      text_start = (const char *)bigbuff + 1;
+      text = tag_convert_utf16_to_utf8 (arena, FALSE, (const BYTE *)text_start, 
         frame_len - 1); 
     }
     else if (encoding == 3)
@@ -346,56 +2756,24 @@ static TagResult tag_read_frame (int f, int version, int *carry_on,
       if (tag_debug)
         printf ("UTF-8 encoding\n");
 
-      text_start = (char *)bigbuff;
-      text = strdup (text_start + 1);
+      *tag_ret = tag_new_utf8_tag (tag_data, name, 
+        bigbuff + 1, frame_len - 1, views);
     }
   else
     {
       if (tag_debug)
         printf ("No encoding -- assuming ISO-8859-1\n");
-      text_start = (char *)bigbuff;
-      text = (char *)tag_convert_iso8859_to_utf8 ((const unsigned char *)
-        text_start, frame_len);
+      text_start = (const char *)bigbuff;
+      text = (char *)tag_convert_iso8859_to_utf8 (arena, 
+        (const unsigned char *)text_start, frame_len);
     }
 
   if (text)
-    {
-    *frame_id_ret = strdup ((char *)frameId);
-    *data_ret = (unsigned char *)text;
-    }
-  }
-  else if (frameId[0] == 'A' && frameId[1] == 'P' && 
-     frameId[2] == 'I' && frameId[3] == 'C')
-  {
-    if (bigbuff[0] == 0)
-    {
-      char mime_type[100];
-      strncpy (mime_type, (char *)bigbuff + 1, 100);
-      if (tag_debug)
-        printf ("Picture MIME %s\n", mime_type);
-
-      char *p = (char *)bigbuff + 1 + strlen (mime_type) + 1;
-      int type = (int) (*p);
-      if (tag_debug)
-        printf ("Picture type %d\n", (int) (*p));
-      if (type == 3) // Front cover
-      {
-        while (*p++); // Skip to end of pic description
-        // p now points to the start of the image data
-        int offset = p - (char *)bigbuff;
-        int to_read = frame_len - offset;
-        tag_data->cover = (unsigned char *) malloc (to_read);
-        if (tag_data->cover)
-        {
-        memcpy (tag_data->cover, p, to_read);
-        tag_data->cover_len = to_read;
-        strncpy (tag_data->cover_mime, mime_type, 
-          sizeof (tag_data->cover_mime));
-        }
-      }
-    }
+    *tag_ret = tag_new_tag (tag_data, name, 
+      (unsigned char *)text);
+  if (!*tag_ret) return TAG_OUTOFMEMORY;
   }
-  else if (strncmp ((char *)frameId, "COMM", 4) == 0)
+  else if (name->key == TAG_KEY ('C','O','M','M'))
   {
     //NOTE
     //  We assume that the 'short' comment is missing -- there will just be 
@@ -407,19 +2785,19 @@ static TagResult tag_read_frame (int f, int version, int *carry_on,
 
     int encoding = bigbuff[0];
     char *text = NULL; // This is where decoded text will end up
-    char *text_start = (char *)bigbuff;
+    const char *text_start = (const char *)bigbuff;
 
-    if (bigbuff[4] == 0)
+    if (frame_len > 8 && bigbuff[4] == 0)
     {
       if (encoding == 0)
       {
         // ISO-8859-1 string, starts after this byte
-        text_start = (char *)bigbuff + 5;
+        text_start = (const char *)bigbuff + 5;
         if (tag_debug)
           printf ("Text frame is ISO-8859-1\n");
 
-        text = (char *)tag_convert_iso8859_to_utf8 ((const unsigned char *)
-           text_start, frame_len - 5);
+        text = (char *)tag_convert_iso8859_to_utf8 (arena, 
+          (const unsigned char *)text_start, frame_len - 5);
       }
       else if (encoding == 1)
       {
@@ -427,8 +2805,8 @@ static TagResult tag_read_frame (int f, int version, int *carry_on,
         if (tag_debug)
           printf ("Text frame is UTF-16 with BOM\n");
 
-        text_start = (char *)bigbuff + 8;
-        text = tag_convert_utf16_to_utf8 (1, (const UTF16 *)text_start, 
+        text_start = (const char *)bigbuff + 8;
+        text = tag_convert_utf16_to_utf8 (arena, TRUE, (const BYTE *)text_start, 
           frame_len - 8); 
       }
       else if (encoding == 2)
@@ -437,8 +2815,8 @@ static TagResult tag_read_frame (int f, int version, int *carry_on,
         if (tag_debug)
           printf ("Text frame is UTF-16E without BOM\n");
 
-        text_start = (char *)bigbuff + 6; 
-        text = tag_convert_utf16_to_utf8 (0, (const UTF16 *)text_start, 
+        text_start = (const char *)bigbuff + 6; 
+        text = tag_convert_utf16_to_utf8 (arena, FALSE, (const BYTE *)text_start, 
           frame_len - 6); 
       }
       else if (encoding == 3)
@@ -446,69 +2824,80 @@ static TagResult tag_read_frame (int f, int version, int *carry_on,
         if (tag_debug)
           printf ("UTF-8 encoding\n");
 
-        text_start = (char *)bigbuff;
-        text = strdup (text_start + 5); 
+        *tag_ret = tag_new_utf8_tag (tag_data, name, 
+          bigbuff + 5, frame_len - 5, views);
       }
     else
       {
         if (tag_debug)
           printf ("No encoding -- assuming ISO-8859-1\n");
-        text_start = (char *)bigbuff;
-        text = (char *)tag_convert_iso8859_to_utf8 ((const unsigned char *)
-          text_start, frame_len);
+        text_start = (const char *)bigbuff;
+        text = (char *)tag_convert_iso8859_to_utf8 (arena, 
+          (const unsigned char *)text_start, frame_len);
       }
-    }
 
-    if (text)
-    {
-      *frame_id_ret = strdup ((char *)frameId);
-      *data_ret = (unsigned char *)text;
+      if (text)
+        *tag_ret = tag_new_tag (tag_data, name, 
+          (unsigned char *)text);
+      if (!*tag_ret) return TAG_OUTOFMEMORY;
     }
   }
-  else
-  {
-    // We only handle text, comment + APIC frames at present
-  }
 
-  free (bigbuff); // FRIG
-  *carry_on = 1; // Should be OK to read next frame
   return TAG_OK;
 }
 
 /*
- * Caller should not assume that tag_data has not been populated just
- * because this function returns an error. Call tag_free_tag_data()
- * anyway
+ * Find the image in an APIC frame of length len, of which avail bytes
+ * are at p. The frame starts with a text encoding byte, then a 
+ * zero-terminated MIME type, a picture type, and a description in the
+ * specified encoding, which is terminated by a zero character.
  */
-TagResult tag_get_id3v2_tags (const char *file, TagData **tag_data_ret)
+static BOOL tag_read_apic_header (const BYTE *p, int avail, int len,
+    TagPicture *pic)
+{
+  const BYTE *end = p + avail;
+
+  if (avail < 1) return FALSE;
+  int encoding = p[0];
+  const BYTE *q = memchr (p + 1, 0, avail - 1);
+  if (!q || end - q < 2) return FALSE;
+  pic->mime = p + 1;
+  pic->mime_len = q - (p + 1);
+  pic->type = q[1];
+  q += 2;
+
+  if (encoding == 1 || encoding == 2)
   {
-  TagData *tag_data = (TagData*) malloc (sizeof (TagData));
-  if (!tag_data)
-    {
-    *tag_data_ret = NULL; 
-    return TAG_OUTOFMEMORY;
-    }
+    // In UTF-16 the terminator is two zero bytes
+    while (end - q >= 2 && (q[0] || q[1])) q += 2;
+    if (end - q < 2) return FALSE;
+    q += 2;
+  }
+  else
+  {
+    q = memchr (q, 0, end - q);
+    if (!q) return FALSE;
+    q++;
+  }
 
-  *tag_data_ret = tag_data; 
-  memset (tag_data, 0, sizeof (TagData));
+  pic->offset = q - p;
+  pic->len = len - pic->offset;
+  return TRUE;
+}
 
-  int f = open (file, O_RDONLY | O_BINARY);
+/*
+ * Parse ID3v2 tags from a stream positioned at the start of the file
+ */
+static TagResult tag_parse_id3v2 (TagStream *s, TagData *tag_data)
+  {
   char buff[10];
   unsigned char b1, b2, b3, b4; 
 
-  if (f <= 0) return TAG_READERROR;
-
-  if (read (f, &buff, 10) != 10)
-    {
-    close (f);
+  if (tag_stream_read (s, buff, 10) != 10)
     return TAG_NOID3V2;
-    }
 
   if (strncmp (buff, "ID3", 3))
-    {
-    close (f);
     return TAG_NOID3V2;
-    }
 
   int id3Major = buff[3];
   int id3Minor = buff[4];
@@ -519,7 +2908,6 @@ TagResult tag_get_id3v2_tags (const char *file, TagData **tag_data_ret)
   if (buff[5] & 0x80)
     {
     // We don't support extended headers yet
-    close (f);
     return TAG_UNSUPFORMAT;
     }
 
@@ -536,36 +2924,60 @@ TagResult tag_get_id3v2_tags (const char *file, TagData **tag_data_ret)
   if (tag_debug)
     printf ("ID3V2 Header length = %d\n", id3len);
 
-  TagResult r;
-  int carry_on = 1;
-  Tag **p_current_tag = &(tag_data->tag); 
-  int total_bytes = 0;
-  do
+  // For most files the whole tag will already be in the stream's prefix,
+  //  so walking the frames costs no I/O. Frames we don't want -- most
+  //  importantly the image in an APIC frame -- are skipped without being 
+  //  read. If the file is shorter than the header says, we'll process 
+  //  what we have, and report the frame that overruns as truncated.
+  off_t tag_end = s->pos + id3len;
+  int header_len = id3Major >= 3 ? 10 : 6;
+  TagResult r = TAG_OK;
+  tag_set_naming (s->wanted, 
+    id3Major >= 3 ? TAG_NAMING_ID3V23 : TAG_NAMING_ID3V22);
+  while (r == TAG_OK && tag_end - s->pos >= header_len 
+      && !tag_wanted_all_found (s->wanted))
     {
-    char *frameId = NULL;
-    unsigned char *data = NULL;
-    r = tag_read_frame (f, id3Major, &carry_on, &frameId, &data, &total_bytes,
-      tag_data); // We pass tag_data here only for the APIC frame
-
-    if (tag_debug)
-      printf ("Read %d bytes from header\n", total_bytes);
+    BYTE header[10];
+    char frameId[5];
+    int frame_len;
+
+    if (tag_stream_read (s, header, header_len) != header_len)
+      break;
+    if (!tag_read_frame_header (header, id3Major, frameId, &frame_len))
+      break;
+    if (frame_len < 1 || frame_len > tag_end - s->pos)
+      {
+      r = TAG_TRUNCATED; // Out-of-spec frame
+      break;
+      }
 
-    if (frameId && data)
+    TagName name;
+    tag_name_init (&name, frameId, strlen (frameId));
+    if ((frameId[0] == 'T' || name.key == TAG_KEY ('C','O','M','M'))
+        && tag_is_wanted (s->wanted, &name))
       {
-      Tag *tag = (Tag *)malloc (sizeof (Tag));
-      memset (tag, 0, sizeof (Tag)); 
-      tag->frameId = frameId;
-      tag->data = data;
-      tag->next = NULL;
-      *p_current_tag = tag; 
-      p_current_tag = &((*p_current_tag)->next);
+      const BYTE *body;
+      BOOL copied;
+      int n = tag_stream_fetch (s, frame_len, &body, &copied);
+      if (n < 0) return TAG_OUTOFMEMORY;
+      if (n != frame_len)
+        r = TAG_TRUNCATED;
+      else
+        {
+        Tag *tag;
+        r = tag_read_frame (tag_data, &name, body, frame_len, 
+          s->views && !copied, &tag); 
+        if (tag)
+          tag_wanted_found (s->wanted, &name);
+        }
       }
-    } while (r == TAG_OK && carry_on && total_bytes < id3len);
+    else if (name.key == TAG_KEY ('A','P','I','C') 
+        && tag_wants_cover (s->wanted))
+      r = tag_read_picture (s, frame_len, tag_read_apic_header, tag_data);
+    else
+      tag_stream_seek (s, frame_len, SEEK_CUR);
+    }
  
-  if (tag_debug)
-    printf ("Read %d bytes from header\n", total_bytes);
-
-  close (f);
   return r;
   }
 
@@ -574,65 +2986,71 @@ TagResult tag_get_id3v2_tags (const char *file, TagData **tag_data_ret)
   FLAC/VORBIS SUPPORT 
 *********************************************************************/
 
-TagResult tag_parse_vorbis_comments (const unsigned char *buff, 
-   Tag **p_current_tag)
+// Note that sizes in Vorbis comments are little-endian, unlike in ID3
+static unsigned int tag_decode_32_bit_lsb (const BYTE *s)
+  {
+  return s[0] + (s[1] << 8) + (s[2] << 16) + ((unsigned int)s[3] << 24);
+  }
+
+// ...but FLAC block fields, like MP4 atom sizes, are big-endian
+static unsigned int tag_decode_32_bit_msb (const BYTE *s)
+  {
+  return ((unsigned int)s[0] << 24) + (s[1] << 16) + (s[2] << 8) + s[3];
+  }
+
+/*
+ * Parse a block of Vorbis comments, of length len, which will have come
+ * from either a FLAC VORBIS_COMMENT block or an Ogg comment header. If
+ * views is TRUE, tag values point into buff rather than being copied.
+ * Only the comments in wanted are decoded, if it isn't NULL.
+ */
+static TagResult tag_parse_vorbis_comments (TagData *tag_data,
+   const unsigned char *buff, int len, BOOL views, TagWanted *wanted)
 {
+  const unsigned char *end = buff + len;
+
+  if (len < 8) return TAG_TRUNCATED;
+
   // Might as well be thorough, but it's unlikely the vendor string
   //  will be megabytes long :)
-  int vend_size = buff[0] + buff[1] * 256 + buff[2] * 256 * 256
-    + buff[3] * 256 * 256 * 256;
-
-  // Note that sizes in Vorbis comments are little-endian, unlike
-  //  in ID3
+  unsigned int vend_size = tag_decode_32_bit_lsb (buff);
+  if (vend_size > (unsigned int)len - 8) return TAG_TRUNCATED;
 
   const unsigned char *p = buff + vend_size + 4;
 
-//printf ("%2x %2x %2x %2x\n", p[0], p[1], p[2], p[3]);
-
-  int num_comments = p[0] + p[1] * 256 + p[2] * 256 * 256
-    + p[3] * 256 * 256 * 256;
+  unsigned int num_comments = tag_decode_32_bit_lsb (p);
 
   p += 4;
 
   if (tag_debug)
     printf ("Block contains %d comments\n", num_comments);
 
-  int i;
-  for (i = 0; i < num_comments; i++)
-  {
-  int comment_length = p[0] + p[1] * 256 + p[2] * 256 * 256
-    + p[3] * 256 * 256 * 256;
+  tag_set_naming (wanted, TAG_NAMING_VORBIS);
 
+  unsigned int i;
+  for (i = 0; i < num_comments && !tag_wanted_all_found (wanted); i++)
+  {
+  if (end - p < 4) return TAG_TRUNCATED;
+  unsigned int comment_length = tag_decode_32_bit_lsb (p);
   p += 4;
+  if (comment_length > (unsigned int)(end - p)) return TAG_TRUNCATED;
 
-  unsigned char *temp = (unsigned char *) malloc (comment_length + 5);
-  
-  strncpy ((char *)temp, (char *)p, comment_length);
-  temp[comment_length] = 0; 
- 
-  char *r = strchr ((char *)temp, '=');
-  if (r)
+  const unsigned char *eq = memchr (p, '=', comment_length);
+  TagName name;
+  if (eq) tag_name_init (&name, (const char *)p, eq - p);
+  if (eq && tag_is_wanted (wanted, &name))
   {
-    *r = 0;
-    char *frameId = strdup ((char *)temp);
-    unsigned char *data = (unsigned char *) strdup (r+1);
+    Tag *tag = tag_new_utf8_tag (tag_data, &name, eq + 1, 
+      comment_length - (eq + 1 - p), views);
+    if (!tag) return TAG_OUTOFMEMORY;
 
     if (tag_debug)
-      printf ("key=%s, value=%s\n", frameId, data);
+      printf ("key=%s, value=%.*s\n", tag->frameId, tag->data_len, 
+        tag->data);
 
-    if (frameId && data)
-    {
-      Tag *tag = (Tag *)malloc (sizeof (Tag));
-      memset (tag, 0, sizeof (Tag)); 
-      tag->frameId = frameId;
-      tag->data = data;
-      tag->next = NULL;
-      *p_current_tag = tag; 
-      p_current_tag = &((*p_current_tag)->next);
-    }
+    tag_wanted_found (wanted, &name);
   }
 
-  free (temp);
   p += comment_length;
   }
 
@@ -640,361 +3058,646 @@ TagResult tag_parse_vorbis_comments (const unsigned char *buff,
 }
 
 
-TagResult tag_get_flac_tags (const char *file, TagData **tag_data_ret)
+/*
+ * Find the image in a FLAC PICTURE block of length len, of which avail
+ * bytes are at p. The block has a picture type, then a length-prefixed
+ * MIME type and description, the image dimensions, and then the length 
+ * of the image data itself.
+ */
+static BOOL tag_read_flac_picture_header (const BYTE *p, int avail, int len,
+    TagPicture *pic)
 {
-  TagData *tag_data = (TagData*) malloc (sizeof (TagData));
-  if (!tag_data)
-    {
-    *tag_data_ret = NULL; 
-    return TAG_OUTOFMEMORY;
-    }
-
-  *tag_data_ret = tag_data; 
-  memset (tag_data, 0, sizeof (TagData));
-
-  int f = open (file, O_RDONLY | O_BINARY);
-  if (f <= 0) return TAG_READERROR;
+  const BYTE *end = p + avail;
+
+  if (avail < 12) return FALSE;
+  pic->type = tag_decode_32_bit_msb (p);
+  unsigned int mime_len = tag_decode_32_bit_msb (p + 4);
+  const BYTE *q = p + 8;
+  if (mime_len > (unsigned int)(end - q - 4)) return FALSE;
+  pic->mime = q;
+  pic->mime_len = mime_len;
+  q += mime_len;
+  unsigned int desc_len = tag_decode_32_bit_msb (q);
+  q += 4;
+  // Description, then width, height, depth, colours, and data length
+  if (end - q < 20 || desc_len > (unsigned int)(end - q - 20)) 
+    return FALSE;
+  q += desc_len + 16;
+  unsigned int data_len = tag_decode_32_bit_msb (q);
+  q += 4;
+  pic->offset = q - p;
+  if (data_len > (unsigned int)(len - pic->offset)) return FALSE;
+  pic->len = data_len;
+  return TRUE;
+}
 
-  unsigned char buff[100];
+/*
+ * Walk the chain of FLAC metadata blocks, decoding VORBIS_COMMENT and
+ * PICTURE blocks as we pass them. In most files the whole chain fits in
+ * the stream's prefix, so this takes no I/O beyond the initial read.
+ * Blocks that don't fit -- typically large pictures or padding -- are 
+ * skipped with a lazy seek; for a picture, only the header is read.
+ */
+static TagResult tag_parse_flac (TagStream *s, TagData *tag_data)
+{
+  unsigned char buff[4];
 
-  if (read (f, buff, 4) != 4)
-  {
-    close (f);
+  if (tag_stream_read (s, buff, 4) != 4)
     return TAG_UNSUPFORMAT;
-  };
 
   if (strncmp ((char *)buff, "fLaC", 4))
-  {
-    close (f);
     return TAG_NOVORBIS;
-  };
 
-  BOOL got_it = FALSE;
+  BOOL got_comments = FALSE;
   BOOL last_block = FALSE; 
+  TagResult ret = TAG_OK;
 
-  while (!got_it && !last_block)
+  while (ret == TAG_OK && !last_block && !tag_wanted_all_found (s->wanted))
   {
-    if (read (f, buff, 4) != 4)
-    {
-      close (f);
-      return TAG_NOVORBIS;
-    }
+    if (tag_stream_read (s, buff, 4) != 4)
+      return got_comments ? TAG_OK : TAG_NOVORBIS;
 
     int block_type = buff[0] & 0x7F;
     last_block = buff[0] & 0x80;
     int block_size = (256 * 256) * buff[1]
        + 256 * buff[2] + buff[3];
  
-    //  printf ("size = %d, last = %d type = %d\n", block_size, 
-    //   last_block, block_type);
+    if (tag_debug)
+      printf ("Found block of type %d, size %d\n", block_type, block_size);
+
+    if (block_type == 6 && tag_wants_cover (s->wanted))
+    {
+      ret = tag_read_picture (s, block_size, tag_read_flac_picture_header, 
+        tag_data);
+    }
+    else if (block_type == 4 && !got_comments)
+    {
+      const BYTE *block;
+      BOOL copied;
+      int n = tag_stream_fetch (s, block_size, &block, &copied);
+
+      if (n < 0)
+        return TAG_OUTOFMEMORY;
+    
+      if (n != block_size)
+        ret = TAG_TRUNCATED;
+      else
+      {
+        got_comments = TRUE;
+        ret = tag_parse_vorbis_comments (tag_data, block, block_size, 
+          s->views && !copied, s->wanted);
+      }
+    }
+    else
+      tag_stream_seek (s, block_size, SEEK_CUR);
+  }
+
+  return ret;
+}
+
+
+/*
+ * Read the header of the Ogg page at the current stream position, 
+ * including its segment table, which is copied to lacing (which must
+ * have room for 255 values). The stream is left at the start of the 
+ * page's data. Returns the number of segments, or -1 if there is no 
+ * valid page here.
+ */
+static int tag_ogg_read_page_header (TagStream *s, BYTE *lacing)
+{
+  BYTE header[27];
+
+  if (tag_stream_read (s, header, 27) != 27) return -1;
+  if (memcmp (header, "OggS", 4) != 0) return -1;
+
+  int segments = header[26];
+  if (tag_stream_read (s, lacing, segments) != segments) return -1;
+
+  if (tag_debug)
+    printf ("Ogg page with %d segments\n", segments);
+
+  return segments;
+}
+
+/*
+ * Parse the comment header packet of an Ogg stream. The packet starts 
+ * with a codec-specific marker, which is followed by Vorbis comments.
+ */
+static TagResult tag_ogg_parse_comment_packet (const BYTE *packet, int len,
+    BOOL views, TagWanted *wanted, TagData *tag_data)
+{
+  int skip;
+
+  if (len >= 7 && memcmp (packet, "\x03vorbis", 7) == 0)
+    skip = 7;
+  else if (len >= 8 && memcmp (packet, "OpusTags", 8) == 0)
+    skip = 8;
+  else if (len >= 7 && memcmp (packet, "\x81theora", 7) == 0)
+    skip = 7;
+  else if (len >= 4 && (packet[0] & 0x7F) == 4)
+    skip = 4; // Ogg FLAC: a VORBIS_COMMENT metadata block header
+  else
+    return TAG_NOVORBIS;
+
+  return tag_parse_vorbis_comments (tag_data, packet + skip, len - skip, 
+    views, wanted);
+}
+
+/*
+ * Ogg comments are in the second packet of the stream. Packets are made
+ * of segments, whose lengths are given in the page headers -- a segment 
+ * shorter than 255 bytes ends a packet -- and a packet may span several
+ * pages. So we walk the pages, skipping the data of the first packet,
+ * and collect the data of the second, stopping as soon as it is complete.
+ */
+static TagResult tag_parse_ogg (TagStream *s, TagData *tag_data)
+{
+  BYTE lacing[255];
+  int packet = 0; // Index of the packet the next segment belongs to
+  BYTE *packet_buff = NULL; // Where a packet that spans pages is gathered
+  int packet_len = 0;
+  BOOL first_page = TRUE;
 
-    if (block_type == 4)
+  while (TRUE)
+  {
+    int segments = tag_ogg_read_page_header (s, lacing);
+    if (segments < 0)
     {
+      if (first_page) return TAG_NOVORBIS;
       if (tag_debug)
-        printf ("Found comment block of size %d\n", block_size);
+        printf ("Ogg stream ended before the comment header\n");
+      return TAG_TRUNCATED;
+    }
+    first_page = FALSE;
+
+    int i = 0;
+    while (i < segments)
+    {
+      // Find how much of this page's data belongs to the current packet
+      int run = 0;
+      BOOL packet_ends = FALSE;
+      while (i < segments && !packet_ends)
+      {
+        run += lacing[i];
+        packet_ends = lacing[i] < 255;
+        i++;
+      }
+
+      if (packet != 1)
+      {
+        tag_stream_seek (s, run, SEEK_CUR);
+      }
+      else if (packet_len == 0 && packet_ends)
+      {
+        // The whole packet is in this page, so we don't need to copy it
+        const BYTE *data;
+        BOOL copied;
+        int n = tag_stream_fetch (s, run, &data, &copied);
+        if (n < 0) return TAG_OUTOFMEMORY;
+        return n == run 
+          ? tag_ogg_parse_comment_packet (data, n, s->views && !copied, 
+            s->wanted, tag_data)
+          : TAG_TRUNCATED;
+      }
+      else
+      {
+        // Nothing else uses the scratch buffer until we're done
+        packet_buff = tag_stream_scratch (s, packet_len + run);
+        if (!packet_buff) return TAG_OUTOFMEMORY;
+
+        if (tag_stream_read (s, packet_buff + packet_len, run) != run)
+          return TAG_TRUNCATED;
+        packet_len += run;
+
+        if (packet_ends)
+        {
+          if (tag_debug)
+            printf ("Ogg comment header is %d bytes\n", packet_len);
+          return tag_ogg_parse_comment_packet (packet_buff, 
+            packet_len, FALSE, s->wanted, tag_data);
+        }
+      }
+
+      if (packet_ends) packet++;
+    }
+  }
+}
 
-      got_it = 1;
 
-      unsigned char *bigbuff = (unsigned char *) malloc (block_size);
+/**********************************************************************
+  QuickTime/MP4/M4A/M4B SUPPORT 
+*********************************************************************/
+
+/*
+ * Parse the items in an ilst atom, whose payload starts at the current 
+ * stream position and ends at end. Each item is an atom whose type is 
+ * the tag name, and whose first child is a 'data' atom holding the value.
+ * Only the text values are read; for the cover image, we just note
+ * where it is.
+ */
+static TagResult tag_mp4_parse_ilst (TagStream *s, off_t end, 
+    TagData *tag_data)
+  {
+  if (tag_debug)
+    printf ("Found MP4 ilst atom\n");
+	
+  tag_set_naming (s->wanted, TAG_NAMING_MP4);
 
-      if (!bigbuff)
+  off_t pos = s->pos;
+  while (end - pos >= 24 && !tag_wanted_all_found (s->wanted))
+    {
+    BYTE header[24];
+    tag_stream_seek (s, pos, SEEK_SET);
+    if (tag_stream_read (s, header, 24) != 24) return TAG_TRUNCATED;
+
+    unsigned int ll = tag_decode_32_bit_msb (header);
+    if (ll < 24 || ll > end - pos) break; // Broken, or not an item
+    const BYTE *type = header + 4;
+    unsigned int data_len = tag_decode_32_bit_msb (header + 8);
+    int data_type = tag_decode_32_bit_msb (header + 16);
+
+    // data_len includes 16 bytes of header material
+    if (data_len < 16 || data_len > ll - 8)
       {
-        close (f);
-        return TAG_OUTOFMEMORY;
+      pos += ll;
+      continue;
       }
-    
-      if (read (f, bigbuff, block_size) != block_size)
+
+    if (data_type == 1) // text
+      {
+      char tag_name[5];
+      if (type[0] == 0xA9)
+        { strncpy (tag_name, (char*)type+1, 3); tag_name[3] = 0; }
+      else
+        { strncpy (tag_name, (char*)type, 4); tag_name[4] = 0; }
+      TagName name;
+      tag_name_init (&name, tag_name, strlen (tag_name));
+      if (!tag_is_wanted (s->wanted, &name))
+        {
+        pos += ll;
+        continue;
+        }
+
+      const BYTE *data;
+      BOOL copied;
+      int n = tag_stream_fetch (s, data_len - 16, &data, &copied);
+      if (n < 0) return TAG_OUTOFMEMORY;
+      if (n != (int)data_len - 16) return TAG_TRUNCATED;
+      if (tag_debug) printf ("Text tag: name=%s, value=%.*s\n", tag_name,
+        n, data);  
+      Tag *tag = tag_new_utf8_tag (tag_data, &name, data, n, 
+        s->views && !copied);
+      if (!tag) return TAG_OUTOFMEMORY;
+      tag_wanted_found (s->wanted, &name);
+      }
+    else // The only non-text we handle is the cover image 
       {
-        close (f);
-        return TAG_TRUNCATED;
+      if (tag_decode_32_bit_msb (type) == TAG_KEY ('c','o','v','r')
+          && tag_wants_cover (s->wanted))
+        {
+        TagPicture pic;
+        pic.mime = (const BYTE *)(data_type == 13 
+          ? "image/jpeg" : "image/png");
+        pic.mime_len = strlen ((const char *)pic.mime);
+        pic.type = 3; // covr is always the front cover
+        pic.len = data_len - 16;
+        TagResult ret = tag_set_cover (s, tag_data, &pic, pos + 24);
+        if (ret != TAG_OK) return ret;
+        }
       }
-    
-      Tag **p_current_tag = &(tag_data->tag); 
-      int ret = tag_parse_vorbis_comments (bigbuff, p_current_tag);
-      
-      free (bigbuff); 
-      close (f);
-      return ret;
+    pos += ll;
     }
-  else
-    lseek (f, block_size, SEEK_CUR);
+
+  return TAG_OK;
+  }
+
+
+/*
+ * Read the header of the atom at the stream position. The atom's total
+ * size, including the header, is returned in *size, and the size of the
+ * header itself in *header_len. A size of 1 means that the real size
+ * follows the type, as a 64-bit number; a size of 0 means that the atom
+ * extends to end, which is the end of the enclosing atom, or -1 if that 
+ * is not known. Returns FALSE if there is no valid header here.
+ */
+static BOOL tag_mp4_read_atom_header (TagStream *s, off_t end, BYTE *type, 
+    off_t *size, int *header_len)
+  {
+  BYTE buff[16];
+  off_t start = s->pos;
+
+  if (tag_stream_read (s, buff, 8) != 8) return FALSE;
+  memcpy (type, buff + 4, 4);
+  *size = tag_decode_32_bit_msb (buff);
+  *header_len = 8;
+
+  if (*size == 1)
+    {
+    if (tag_stream_read (s, buff + 8, 8) != 8) return FALSE;
+    *size = ((off_t)tag_decode_32_bit_msb (buff + 8) << 32) 
+      + tag_decode_32_bit_msb (buff + 12);
+    *header_len = 16;
+    }
+  else if (*size == 0)
+    {
+    *size = end >= 0 ? end - start : ((off_t)1 << 62);
+    }
+
+  if (*size < *header_len) return FALSE;
+  if (end >= 0 && start + *size > end) return FALSE;
+
+  return TRUE;
+  }
+
+
+/*
+ * MP4 metadata is in moov/udta/meta/ilst. moov is usually mostly taken up
+ * by the sample tables in trak, which can be megabytes long in an 
+ * audiobook, so rather than reading moov, we descend through the atom 
+ * headers along that path, seeking past everything else, and only read 
+ * the ilst atom.
+ */
+static TagResult tag_parse_mp4 (TagStream *s, TagData *tag_data)
+  {
+  static const TagKey path[] = { TAG_KEY ('m','o','o','v'), 
+    TAG_KEY ('u','d','t','a'), TAG_KEY ('m','e','t','a'), 
+    TAG_KEY ('i','l','s','t') };
+  const int path_len = sizeof (path) / sizeof (path[0]);
+  int depth = 0;
+  off_t pos = 0;
+  off_t end = -1; // End of the atom we're in, or -1 at the top level
+
+  while (end < 0 || pos + 8 <= end)
+    {
+    BYTE type[4];
+    off_t size;
+    int header_len;
+
+    tag_stream_seek (s, pos, SEEK_SET);
+    if (!tag_mp4_read_atom_header (s, end, type, &size, &header_len))
+      {
+      if (tag_debug) printf ("Reached end of MP4 atoms\n"); 
+      break;
+      }
+
+    if (tag_decode_32_bit_msb (type) != path[depth])
+      {
+      pos += size;
+      continue;
+      }
+
+    if (tag_debug)
+      printf ("Found MP4 %.4s atom, size %lld\n", type, 
+        (long long)size);
+
+    off_t payload = pos + header_len;
+    // meta has a 4-byte version and flags before its children
+    if (depth == 2) payload += 4;
+
+    if (depth == path_len - 1)
+      return tag_mp4_parse_ilst (s, pos + size, tag_data);
+
+    depth++;
+    end = pos + size;
+    pos = payload;
+    }
+
+  return TAG_OK;
+  }
+
+
+/**********************************************************************
+  FORMAT DISPATCH
+*********************************************************************/
+
+typedef TagResult (*TagParser) (TagStream *s, TagData *tag_data);
+
+/*
+ * Work out the format of a stream from its prefix, and run the parser
+ * for that format
+ */
+static TagResult tag_parse_stream (TagStream *s, TagData *tag_data)
+{
+  TagResult ret;
+
+  switch (tag_sniff_format (s->prefix, s->prefix_len))
+  {
+    case TAG_FORMAT_ID3V2:
+      ret = tag_parse_id3v2 (s, tag_data);
+      break;
+    case TAG_FORMAT_FLAC:
+      ret = tag_parse_flac (s, tag_data);
+      break;
+    case TAG_FORMAT_OGG:
+      ret = tag_parse_ogg (s, tag_data);
+      break;
+    case TAG_FORMAT_MP4:
+      ret = tag_parse_mp4 (s, tag_data);
+      break;
+    default:
+      if (tag_debug)
+        printf ("File format not recognized\n");
+      ret = TAG_UNSUPFORMAT;
   }
 
-  close (f);
-  return TAG_OK;
+  if (ret == TAG_NOID3V2 || ret == TAG_NOVORBIS || ret == TAG_NOMP4)
+    ret = TAG_UNSUPFORMAT;
+
+  return ret;
 }
 
+/*
+ * Whether a file that starts with these bytes is in one of the formats
+ * that we can parse
+ */
+BOOL tag_sniff (const BYTE *buff, size_t len)
+  {
+  return tag_sniff_format (buff, len) != TAG_FORMAT_UNKNOWN;
+  }
 
-TagResult tag_get_ogg_tags (const char *file, TagData **tag_data_ret)
-{
-  TagData *tag_data = (TagData*) malloc (sizeof (TagData));
+/*
+ * Allocate an empty TagData for the caller, from arena if it is not NULL,
+ * or from a new arena of its own if it is.
+ */
+static TagResult tag_new_tag_data (TagArena *arena, TagData **tag_data_ret)
+  {
+  *tag_data_ret = NULL; 
+  BOOL owns_arena = !arena;
+  if (owns_arena)
+    {
+    arena = tag_arena_new ();
+    if (!arena) return TAG_OUTOFMEMORY;
+    }
+
+  TagData *tag_data = (TagData*) tag_arena_alloc (arena, sizeof (TagData));
   if (!tag_data)
     {
-    *tag_data_ret = NULL; 
+    if (owns_arena) tag_arena_free (arena);
     return TAG_OUTOFMEMORY;
     }
+
   *tag_data_ret = tag_data; 
   memset (tag_data, 0, sizeof (TagData));
+  tag_data->arena = arena;
+  tag_data->owns_arena = owns_arena;
+  int c;
+  for (c = 0; c < TAG_COMMON_COUNT; c++)
+    tag_data->common[c] = -1;
+  return TAG_OK;
+  }
 
-  int f = open (file, O_RDONLY | O_BINARY);
-  if (f <= 0) return TAG_READERROR;
+/*
+ * Allocate an empty TagData, and open the file as a stream. The
+ * TagData is returned to the caller even if the open fails, because
+ * callers are expected to free it regardless of outcome.
+ */
+static TagResult tag_begin (const char *file, TagArena *arena, 
+    TagStream *s, TagData **tag_data_ret)
+  {
+  TagResult ret = tag_new_tag_data (arena, tag_data_ret);
+  if (ret != TAG_OK) return ret;
 
-  unsigned char buff[100];
+  return tag_stream_open (s, file);
+  }
 
-  if (read (f, buff, 4) != 4)
+/*
+ * Read tags from a file by mapping it into memory, and parsing it in 
+ * place. Text values that are already UTF-8 in the file -- Vorbis 
+ * comments, MP4 text atoms, and ID3v2 frames in UTF-8 -- are not copied: 
+ * the tags point into the mapping, which is kept until the TagData is 
+ * freed. Such values are not zero-terminated: use tag_get_value() to 
+ * get their lengths, or tag_get_text() to get a terminated copy.
+ */
+TagResult tag_get_tags_mmap (const char *file, TagData **tag_data_ret)
   {
-    close (f);
-    return TAG_UNSUPFORMAT;
-  };
+#ifdef _WIN32
+  return tag_get_tags (file, tag_data_ret);
+#else
+  TagResult ret = tag_new_tag_data (NULL, tag_data_ret);
+  if (ret != TAG_OK) return ret;
+  TagData *tag_data = *tag_data_ret;
+
+  TAG_STAT_ADD (opens, 1);
+  int f = open (file, O_RDONLY | O_BINARY);
+  if (f < 0) return TAG_READERROR;
 
-  if (strncmp ((char *)buff, "OggS", 4))
-  {
+  struct stat sb;
+  if (fstat (f, &sb) != 0)
+    {
     close (f);
-    return TAG_NOVORBIS;
-  };
-
-  if (tag_debug)
-    printf ("Found Ogg marker\n");
-
-  int page_start = 0;
-  lseek (f, page_start + 26, SEEK_SET);
-  read (f, buff, 1);
-  int segments = buff[0];
-  
-  int i;
-  int total_seg_size = 0;
-  for (i = 0; i < segments; i++)
+    return TAG_READERROR;
+    }
+  if (sb.st_size == 0)
     {
-    lseek (f, page_start + 27 + i, SEEK_SET);
-    read (f, buff, 1);
-    int seg_size = buff[0];
-    total_seg_size += seg_size;
+    close (f);
+    return TAG_UNSUPFORMAT;
     }
 
-   int page_size = 27 + segments + total_seg_size;
-   if (tag_debug)
-       printf ("Ogg page size is %d\n", page_size);
-
-   lseek (f, page_start + page_size, SEEK_SET);
-   read (f, buff, 4);
-   if (strncmp ((char *)buff, "OggS", 4))
-     {
-     if (tag_debug)
-       printf ("Page length offset does not indicate next page\n");
-     return TAG_NOVORBIS;
-     }
-
-  page_start = page_start + page_size;
-  lseek (f, page_start + 26, SEEK_SET);
-  read (f, buff, 1);
-  segments = buff[0];
-  lseek (f, page_start + 27 + segments + 7, SEEK_SET);
-
-  // Memory is cheap, especially if temporary. Need to be sure to capture
-  //  all the comments, but it doesn't matter if we read too much
-  int bigbuff_size = 4096;
-  char *bigbuff = malloc (bigbuff_size);
-  memset (bigbuff, 0, bigbuff_size);
-  read (f, bigbuff, bigbuff_size);
-
-  Tag **p_current_tag = &(tag_data->tag); 
-  int ret = tag_parse_vorbis_comments ((unsigned char *)bigbuff, p_current_tag);
-
+  void *map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, f, 0);
   close (f);
+  if (map == MAP_FAILED) return TAG_READERROR;
 
-  return ret;
-}
-
+  tag_data->map = map;
+  tag_data->map_len = sb.st_size;
 
-/**********************************************************************
-  QuickTime/MP4/M4A/M4B SUPPORT 
-*********************************************************************/
+  TagStream s;
+  tag_stream_open_memory (&s, map, sb.st_size, TRUE);
+  ret = tag_parse_stream (&s, tag_data);
+  tag_stream_close (&s);
+  return ret;
+#endif
+  }
 
-static int tag_mp4_decode_32_bit_msb (const BYTE *s)
+/*
+ * Read tags from a file using one specific parser
+ */
+static TagResult tag_get_with_parser (const char *file, TagParser parser,
+    TagData **tag_data_ret)
   {
-  return (s[0] << 24) + (s[1] << 16) + (s[2] << 8) + s[3];
+  TagStream s;
+  TagResult ret = tag_begin (file, NULL, &s, tag_data_ret);
+  if (ret != TAG_OK) return ret;
+  ret = parser (&s, *tag_data_ret);
+  tag_stream_close (&s);
+  return ret;
   }
 
-
-void tag_mp4_parse_ilst (const BYTE *ilist, int l, TagData *tag_data)
+/*
+ * Caller should not assume that tag_data has not been populated just
+ * because this function returns an error. Call tag_free_tag_data()
+ * anyway
+ */
+TagResult tag_get_id3v2_tags (const char *file, TagData **tag_data_ret)
   {
-  if (tag_debug)
-    printf ("Found MP4 ilst atom\n");
-	
-  const BYTE *p = ilist;
-  p += 0;
-  while (p - ilist < l)
-    {
-    int ll = tag_mp4_decode_32_bit_msb (p);
-    const BYTE *type = p + 4;
-    const BYTE *dlen = p + 8;
-    int data_len = tag_mp4_decode_32_bit_msb (dlen);
-    const BYTE *dtype = p + 16;
-    int data_type = tag_mp4_decode_32_bit_msb (dtype);
-    const BYTE *data = p + 24;
-
-    if (data_type == 1) // text
-      {
-      char tag_name[5];
-      if (type[0] == 0xA9)
-        { strncpy (tag_name, (char*)type+1, 3); tag_name[3] = 0; }
-      else
-        { strncpy (tag_name, (char*)type, 4); tag_name[4] = 0; }
-      if (tag_debug) printf ("Text tag: name=%s, value=%s\n", tag_name, data);  
-      Tag *p_tag = tag_data->tag; 
-      Tag *tag = malloc (sizeof (Tag));
-      tag->frameId = strdup (tag_name);
-      tag->type = TAG_TYPE_TEXT;
-      // data_len includes 16 bytes of header material
-      tag->data = (unsigned char*) malloc (data_len + 1 - 16);
-      memcpy (tag->data, data, data_len - 16);
-      tag->data[data_len - 16] = 0;
-      tag->next = p_tag;
-      tag_data->tag = tag;
-      }
-    else // The only non-text we handle is the cover image 
-      {
-      if (strncmp ((char*)type, "covr", 4) == 0)
-        {
-        tag_data->cover = (unsigned char *) malloc (data_len);
-        memcpy (tag_data->cover, data, data_len);
-        tag_data->cover_len = data_len;
-        if (data_type == 13)
-          strcpy (tag_data->cover_mime, "image/jpeg");
-        else
-          strcpy (tag_data->cover_mime, "image/png");
-        }
-      }
-    p += ll;
-    }
+  return tag_get_with_parser (file, tag_parse_id3v2, tag_data_ret);
   }
 
-
-void tag_mp4_parse_meta (const BYTE *meta, int l, TagData *tag_data)
+TagResult tag_get_flac_tags (const char *file, TagData **tag_data_ret)
   {
-  if (tag_debug)
-    printf ("Found MP4 meta atom\n");
-	
-  const BYTE *p = meta;
-  p += 4;
-  while (p - meta < l)
-    {
-    int ll = tag_mp4_decode_32_bit_msb (p);
-    const BYTE *type = p + 4;
-    if (strncmp ((char *)type, "ilst", 4) == 0)
-      {
-      tag_mp4_parse_ilst (p + 8, ll - 8, tag_data);
-      }
-    p += ll;
-    }
+  return tag_get_with_parser (file, tag_parse_flac, tag_data_ret);
   }
 
-
-void tag_mp4_parse_udta (const BYTE *udta, int l, TagData *tag_data)
+TagResult tag_get_ogg_tags (const char *file, TagData **tag_data_ret)
   {
-  if (tag_debug)
-    printf ("Found MP4 udta atom\n");
-	
-  const BYTE *p = udta;
-  while (p - udta < l)
-    {
-    int ll = tag_mp4_decode_32_bit_msb (p);
-    const BYTE *type = p + 4;
-    if (strncmp ((char *)type, "meta", 4) == 0)
-      {
-      tag_mp4_parse_meta (p + 8, ll - 8, tag_data);
-      }
-    p += ll;
-    }
+  return tag_get_with_parser (file, tag_parse_ogg, tag_data_ret);
   }
 
-
-void tag_mp4_parse_moov (const BYTE *moov, int l, TagData *tag_data)
+TagResult tag_get_mp4_tags (const char *file, TagData **tag_data_ret)
   {
-  const BYTE *p = moov;
-  while (p - moov < l)
-    {
-    int ll = tag_mp4_decode_32_bit_msb (p);
-    const BYTE *type = p + 4;
-   if (strncmp ((char *)type, "udta", 4) == 0)
-     {
-     tag_mp4_parse_udta (p + 8, ll - 8, tag_data);
-     }
-    p += ll;
-    }
+  return tag_get_with_parser (file, tag_parse_mp4, tag_data_ret);
   }
 
+/*
+ * Read tags from a file that the caller already has in memory, using one
+ * specific parser. Tag values are copied, so the caller's buffer need
+ * not outlive the TagData.
+ */
+static TagResult tag_get_from_buffer_with_parser (const BYTE *buff, 
+    size_t len, TagParser parser, TagData **tag_data_ret)
+  {
+  TagResult ret = tag_new_tag_data (NULL, tag_data_ret);
+  if (ret != TAG_OK) return ret;
 
+  TagStream s;
+  tag_stream_open_memory (&s, buff, len, FALSE);
+  ret = parser (&s, *tag_data_ret);
+  tag_stream_close (&s);
+  return ret;
+  }
 
-TagResult tag_get_mp4_tags (const char *file, TagData **tag_data_ret)
+TagResult tag_get_tags_from_buffer (const BYTE *buff, size_t len, 
+    TagData **tag_data_ret)
   {
-  TagData *tag_data = (TagData*) malloc (sizeof (TagData));
-  if (!tag_data)
-    {
-    *tag_data_ret = NULL; 
-    return TAG_OUTOFMEMORY;
-    }
+  return tag_get_from_buffer_with_parser (buff, len, tag_parse_stream, 
+    tag_data_ret);
+  }
 
-  *tag_data_ret = tag_data; 
-  memset (tag_data, 0, sizeof (TagData));
+TagResult tag_get_id3v2_tags_from_buffer (const BYTE *buff, size_t len, 
+    TagData **tag_data_ret)
+  {
+  return tag_get_from_buffer_with_parser (buff, len, tag_parse_id3v2, 
+    tag_data_ret);
+  }
 
-  int f = open (file, O_RDONLY | O_BINARY);
-  if (f <= 0) return TAG_READERROR;
+TagResult tag_get_flac_tags_from_buffer (const BYTE *buff, size_t len, 
+    TagData **tag_data_ret)
+  {
+  return tag_get_from_buffer_with_parser (buff, len, tag_parse_flac, 
+    tag_data_ret);
+  }
 
-  BOOL done = FALSE;
-  while (!done)
-    {
-    BYTE buff[4];
-    int n = read (f, buff, 4);
-    if (n == 4)
-      {
-      int l = tag_mp4_decode_32_bit_msb (buff);
-      // l should be positive, unless this is a broken file
-      //   or, of course, a file that isn't an MP4
-      if (l < 0)       
-        {
-        done = TRUE;
-        continue;
-        }
-      int n = read (f, buff, 4);
-      if (n == 4)
-        {
-        BOOL read_atom = FALSE;
-        if (strncmp ((char *)buff, "moov", 4) == 0)
-          {
-          if (tag_debug)
-            printf ("Found MP3 moov atom\n");
-          BYTE *atom = malloc (l - 8 + 1);
-          int n = read (f, atom, l - 8);
-          if (n == l - 8)
-            {
-            read_atom = TRUE;
-            tag_mp4_parse_moov (atom, l - 8, tag_data);
-            }
-          else
-            done = TRUE;
-          free (atom);
-          }
-        if (!read_atom)
-          {
-          lseek (f, l - 8, SEEK_CUR);
-          }
-        }
-      else
-        {
-        done = TRUE;
-        if (tag_debug) printf ("Unexpected end of MP4 file\n"); 
-        }
-      }
-   else 
-     {
-     done = TRUE;
-     if (tag_debug) printf ("Reached end of MP4 file\n"); 
-     }
-   }
+TagResult tag_get_ogg_tags_from_buffer (const BYTE *buff, size_t len, 
+    TagData **tag_data_ret)
+  {
+  return tag_get_from_buffer_with_parser (buff, len, tag_parse_ogg, 
+    tag_data_ret);
+  }
 
-  close (f);
-  return TAG_OK;
+TagResult tag_get_mp4_tags_from_buffer (const BYTE *buff, size_t len, 
+    TagData **tag_data_ret)
+  {
+  return tag_get_from_buffer_with_parser (buff, len, tag_parse_mp4, 
+    tag_data_ret);
   }
 
 
@@ -1005,17 +3708,10 @@ TagResult tag_get_mp4_tags (const char *file, TagData **tag_data_ret)
 /*
  * Returns the number of tags in the tag_data structure, if any
  */
-int tag_get_tag_count (TagData *tag_data)
+int tag_get_tag_count (const TagData *tag_data)
 {
   if (!tag_data) return 0;
-  int count = 0;
-  Tag *t = tag_data->tag;
-  while (t)
-  {
-    count++;
-    t = t->next;
-  }
-  return count;
+  return tag_data->tag_count;
 }
 
 /*
@@ -1026,17 +3722,11 @@ int tag_get_tag_count (TagData *tag_data)
 void tag_free_tag_data (TagData *tag_data)
 {
   if (!tag_data) return;
-  Tag *t = tag_data->tag;
-  while (t)
-  {
-    free (t->frameId);
-    free (t->data);
-    Tag *tt = t;
-    t = t->next;
-    free (tt);
-  }
-  if (tag_data->cover) free (tag_data->cover);
-  free (tag_data);
+#ifndef _WIN32
+  if (tag_data->map) munmap (tag_data->map, tag_data->map_len);
+#endif
+  // Everything else, including tag_data itself, is in the arena
+  if (tag_data->owns_arena) tag_arena_free (tag_data->arena);
 }
 
 
@@ -1049,22 +3739,65 @@ void tag_free_tag_data (TagData *tag_data)
 
 Tag *tag_get_tag (const TagData *tag_data, int index) 
 {
-  if (!tag_data) return NULL;
-  int count = 0;
-  Tag *t = tag_data->tag;
-  while (t)
+  if (!tag_data || index < 0 || index >= tag_data->tag_count) return NULL;
+  return &tag_data->tags[index];
+}
+
+/*
+ * Start an iteration over the tags in a TagData, in file order
+ */
+void tag_iter_init (TagIterator *iter, const TagData *tag_data)
+{
+  iter->tag_data = tag_data;
+  iter->index = 0;
+}
+
+/*
+ * Returns the next tag in an iteration, or NULL when there are no more
+ */
+Tag *tag_iter_next (TagIterator *iter)
+{
+  return tag_get_tag (iter->tag_data, iter->index++);
+}
+
+
+/*
+ * Returns a tag's value, and its length in bytes in *len. The value is
+ * UTF-8 text, but it is not necessarily zero-terminated -- tags read by 
+ * tag_get_tags_mmap() point straight into the mapped file. The caller
+ * must not modify or free the value.
+ */
+const unsigned char *tag_get_value (const Tag *tag, int *len)
+{
+  *len = tag->data_len;
+  return tag->data;
+}
+
+/*
+ * Returns a tag's value as a zero-terminated string. For tags that are
+ * views into a mapped file, the value is copied into the TagData's arena
+ * when this function is first called, and the tag is changed to point to
+ * the copy. The copy is only a cache, which doesn't change the tag's 
+ * value, so the tag is const all the same -- but two threads must not 
+ * call this for tags of the same TagData at the same time. Returns NULL 
+ * only if we run out of memory.
+ */
+const unsigned char *tag_get_text (const Tag *tag)
+{
+  if (tag->is_view)
   {
-    if (count == index)
-    {
-      return t;
-    }
-    count++;
-    t = t->next;
+    // Caching the copy doesn't change the tag's value, so we allow 
+    //  ourselves to modify it here
+    Tag *t = (Tag *)tag;
+    unsigned char *copy = (unsigned char *)tag_strndup 
+      (t->arena, (const char *)t->data, t->data_len);
+    if (!copy) return NULL;
+    t->data = copy;
+    t->is_view = FALSE;
   }
-  return NULL;
+  return tag->data;
 }
 
-
 /*
  *  Gets a tag's text from the frame ID. Note that frame IDs are
  *  not the same in different revisions of the ID3v2 spec :/
@@ -1073,14 +3806,16 @@ Tag *tag_get_tag (const TagData *tag_data, int index)
  */
 const unsigned char *tag_get_by_id (const TagData *tag_data, const char *id)
 {
-  Tag *t = tag_data->tag;
-  while (t)
+  TagName name;
+  tag_name_init (&name, id, strlen (id));
+  int i;
+  for (i = 0; i < tag_data->tag_count; i++)
   {
-    if (strcasecmp (t->frameId, id) == 0)
+    const Tag *t = &tag_data->tags[i];
+    if (t->key == name.key && strcasecmp (t->frameId, id) == 0)
     {
-      return t->data;
+      return tag_get_text (&tag_data->tags[i]);
     }
-    t = t->next;
   }
   return NULL;
 }
@@ -1094,99 +3829,311 @@ const unsigned char *tag_get_by_id (const TagData *tag_data, const char *id)
  * when gettags got support for MP4, which includes full dates rather
  * that just years.
  *
- * All results are in UTF-8 encoding
+ * All results are in UTF-8 encoding. Like tag_get_text(), which it uses, 
+ * this may copy the value into the TagData.
  */
 const unsigned char *tag_get_common (const TagData *tag_data, TagCommonID id)
 {
-  const unsigned char *s;
-  switch (id)
-  {
-  case TAG_COMMON_TITLE:
-    s = tag_get_by_id (tag_data, "TIT2");
-    if (!s) s = tag_get_by_id (tag_data, "TT2");
-    if (!s) s = tag_get_by_id (tag_data, "TITLE");
-    if (!s) s = tag_get_by_id (tag_data, "nam");
-    return s;
-  case TAG_COMMON_ARTIST:
-    s = tag_get_by_id (tag_data, "TPE1");
-    if (!s) s = tag_get_by_id (tag_data, "TP1");
-    if (!s) s = tag_get_by_id (tag_data, "ARTIST");
-    if (!s) s = tag_get_by_id (tag_data, "PERFORMER");
-    if (!s) s = tag_get_by_id (tag_data, "ART");
-    return s;
-  case TAG_COMMON_ALBUM_ARTIST:
-    s = tag_get_by_id (tag_data, "TPE2");
-    if (!s) s = tag_get_by_id (tag_data, "TP2");
-    if (!s) s = tag_get_by_id (tag_data, "ALBUMARTIST");
-    if (!s) s = tag_get_by_id (tag_data, "aART");
-    return s;
-  case TAG_COMMON_GENRE:
-    s = tag_get_by_id (tag_data, "TCON");
-    if (!s) s = tag_get_by_id (tag_data, "TCO");
-    if (!s) s = tag_get_by_id (tag_data, "GENRE");
-    if (!s) s = tag_get_by_id (tag_data, "gen");
-    if (!s) s = tag_get_by_id (tag_data, "gnre");
-    return s;
-  case TAG_COMMON_ALBUM:
-    s = tag_get_by_id (tag_data, "TALB");
-    if (!s) s = tag_get_by_id (tag_data, "TAL");
-    if (!s) s = tag_get_by_id (tag_data, "ALBUM");
-    if (!s) s = tag_get_by_id (tag_data, "ALBUM");
-    if (!s) s = tag_get_by_id (tag_data, "alb");
-    return s;
-  case TAG_COMMON_COMPOSER:
-    s = tag_get_by_id (tag_data, "TCOM");
-    if (!s) s = tag_get_by_id (tag_data, "TCM");
-    if (!s) s = tag_get_by_id (tag_data, "COMPOSER");
-    if (!s) s = tag_get_by_id (tag_data, "wrt");
-    return s;
-  case TAG_COMMON_YEAR:
-  case TAG_COMMON_DATE:
-    s = tag_get_by_id (tag_data, "TYER");
-    if (!s) s = tag_get_by_id (tag_data, "TYE");
-    if (!s) s = tag_get_by_id (tag_data, "DATE");
-    if (!s) s = tag_get_by_id (tag_data, "day");
-    return s;
-  case TAG_COMMON_TRACK:
-    s = tag_get_by_id (tag_data, "TRCK");
-    if (!s) s = tag_get_by_id (tag_data, "TRK");
-    if (!s) s = tag_get_by_id (tag_data, "TRACKNUMBER");
-    if (!s) s = tag_get_by_id (tag_data, "trkn");
-    return s;
-  case TAG_COMMON_COMMENT:
-    s = tag_get_by_id (tag_data, "COMM");
-    if (!s) s = tag_get_by_id (tag_data, "COM");
-    if (!s) s = tag_get_by_id (tag_data, "DESCRIPTION");
-    if (!s) s = tag_get_by_id (tag_data, "COMMENT");
-    if (!s) s = tag_get_by_id (tag_data, "cmt");
-    return s;
-  }
-  return NULL;
+  if (id < 0 || id >= TAG_COMMON_COUNT || tag_data->common[id] < 0) 
+    return NULL;
+  return tag_get_text (&tag_data->tags[tag_data->common[id]]);
 }
 
 
-TagResult tag_get_tags (const char *file, TagData **tag_data_ret)
+/*
+ * Read tags from a file, allocating the TagData from arena (or a new
+ * arena, if it is NULL), and using scratch for any data that has to be
+ * copied out of the file (or a scratch buffer of the stream's own, if it 
+ * is NULL).
+ */
+static TagResult tag_get_tags_with_scratch (const char *file, 
+    const TagFilter *filter, TagArena *arena, TagScratch *scratch, 
+    TagPool *pool, TagData **tag_data_ret)
 {
-  TagResult ret = tag_get_id3v2_tags (file, tag_data_ret);
-  if (ret == TAG_NOID3V2)
+  TagStream s;
+  TagResult ret = tag_begin (file, arena, &s, tag_data_ret);
+  if (ret != TAG_OK) return ret;
+  TagData *tag_data = *tag_data_ret;
+  if (scratch) s.scratch = scratch;
+  tag_data->pool = pool;
+
+  // The filter's working arrays are only needed while parsing, so they
+  //  come from the heap, not the arena, which may be a pool's
+  TagWanted wanted;
+  memset (&wanted, 0, sizeof (wanted));
+  if (filter)
   {
-    tag_free_tag_data (*tag_data_ret);
-    ret = tag_get_flac_tags (file, tag_data_ret);
-    if (ret == TAG_NOVORBIS)
+    wanted.filter = filter;
+    wanted.common_left = filter->common 
+      & (TAG_COMMON_BIT (TAG_COMMON_COUNT) - 1);
+    wanted.ids_left = filter->n_ids;
+    if (filter->n_ids > 0)
     {
-      tag_free_tag_data (*tag_data_ret);
-      ret = tag_get_ogg_tags (file, tag_data_ret);
-      if (ret == TAG_NOVORBIS)
+      wanted.id_found = calloc (filter->n_ids, sizeof (BOOL));
+      wanted.id_keys = malloc (filter->n_ids * sizeof (TagKey));
+      if (!wanted.id_found || !wanted.id_keys)
       {
-        tag_free_tag_data (*tag_data_ret);
-        ret = tag_get_mp4_tags (file, tag_data_ret);
-        if (ret == TAG_NOMP4)
-	  ret = TAG_UNSUPFORMAT;
+        free (wanted.id_found);
+        free (wanted.id_keys);
+        tag_stream_close (&s);
+        return TAG_OUTOFMEMORY;
+      }
+      int i;
+      for (i = 0; i < filter->n_ids; i++)
+      {
+        TagName name;
+        tag_name_init (&name, filter->ids[i], strlen (filter->ids[i]));
+        wanted.id_keys[i] = name.key;
       }
     }
+    s.wanted = &wanted;
   }
 
+  ret = tag_parse_stream (&s, tag_data);
+  tag_stream_close (&s);
+  free (wanted.id_found);
+  free (wanted.id_keys);
+  if (tag_finish_tags (tag_data) != TAG_OK) ret = TAG_OUTOFMEMORY;
   return ret;
 }
 
+/*
+ * Read tags from a file of any supported type. The file is opened and 
+ * its header read only once; the format is worked out from the magic
+ * number at the start, and only the parser for that format is run.
+ */
+TagResult tag_get_tags (const char *file, TagData **tag_data_ret)
+{
+  return tag_get_with_parser (file, tag_parse_stream, tag_data_ret);
+}
+
+/*
+ * Read only the tags in filter from a file of any supported type. Other
+ * frames and comments are skipped without being decoded, or in most 
+ * cases read, and parsing stops as soon as everything in the filter has
+ * been found.
+ */
+TagResult tag_get_tags_filtered (const char *file, const TagFilter *filter, 
+    TagData **tag_data_ret)
+{
+  return tag_get_tags_in_arena (file, filter, NULL, tag_data_ret);
+}
+
+/*
+ * Read tags from a file of any supported type, allocating the TagData
+ * from arena. If filter is not NULL, only the tags it selects are read,
+ * as for tag_get_tags_filtered().
+ */
+TagResult tag_get_tags_in_arena (const char *file, const TagFilter *filter,
+    TagArena *arena, TagData **tag_data_ret)
+{
+  return tag_get_tags_with_scratch (file, filter, arena, NULL, NULL, 
+    tag_data_ret);
+}
+
+/*
+ * Read tags from a file, using a TagContext's arena and scratch buffer.
+ * The context's arena is reset first, so anything read with the context
+ * before is invalid after this. The TagData need not be freed, but 
+ * there's no harm in doing so.
+ */
+TagResult tag_ctx_get_tags (TagContext *ctx, const char *file, 
+    const TagFilter *filter, TagData **tag_data_ret)
+{
+  tag_arena_reset (ctx->arena);
+  return tag_get_tags_with_scratch (file, filter, ctx->arena, 
+    &ctx->scratch, NULL, tag_data_ret);
+}
+
+/*
+ * Read tags from a file, allocating the TagData from a pool, and 
+ * sharing the pool's copies of tag names and values that it already has.
+ * filter may be NULL, to read all the tags.
+ */
+TagResult tag_get_tags_pooled (const char *file, const TagFilter *filter,
+    TagPool *pool, TagData **tag_data_ret)
+{
+  return tag_get_tags_with_scratch (file, filter, pool->arena, NULL, pool,
+    tag_data_ret);
+}
+
+TagContext *tag_ctx_new (void)
+{
+  TagContext *ctx = malloc (sizeof (TagContext));
+  if (!ctx) return NULL;
+  memset (ctx, 0, sizeof (TagContext));
+  ctx->arena = tag_arena_new ();
+  if (!ctx->arena)
+  {
+    free (ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void tag_ctx_free (TagContext *ctx)
+{
+  if (!ctx) return;
+  tag_arena_free (ctx->arena);
+  free (ctx->scratch.buff);
+  free (ctx);
+}
+
+/**********************************************************************
+  SERIALIZATION
+*********************************************************************/
+
+/*
+ * A serialized TagData is a TagBlob header, then a TagBlobTag for each
+ * tag, then the strings. Offset zero is the header, so an offset of zero
+ * means that there is no string.
+ */
+
+// Copy len bytes of s, and a terminator, to the blob at *pos
+static uint32_t tag_blob_put (BYTE *blob, size_t *pos, const void *s, 
+    size_t len)
+  {
+  uint32_t offset = *pos;
+  memcpy (blob + *pos, s, len);
+  blob[*pos + len] = 0;
+  *pos += len + 1;
+  return offset;
+  }
+
+TagResult tag_serialize (const TagData *tag_data, void **blob_ret, 
+    size_t *len_ret)
+  {
+  *blob_ret = NULL;
+  *len_ret = 0;
+
+  // Work out how big it will be
+  size_t size = sizeof (TagBlob) + tag_data->tag_count * sizeof (TagBlobTag);
+  int i;
+  for (i = 0; i < tag_data->tag_count; i++)
+    {
+    const Tag *tag = &tag_data->tags[i];
+    size += strlen (tag->frameId) + 1 + tag->data_len + 1;
+    }
+  if (tag_data->cover_len)
+    size += strlen (tag_data->cover_mime) + 1;
+  if (tag_data->cover_file)
+    size += strlen (tag_data->cover_file) + 1;
+  if (size > UINT32_MAX) return TAG_OUTOFMEMORY;
+
+  BYTE *blob = malloc (size);
+  if (!blob) return TAG_OUTOFMEMORY;
+  TagBlob *header = (TagBlob *)blob;
+  memset (header, 0, sizeof (TagBlob));
+  memcpy (header->magic, TAG_BLOB_MAGIC, 4);
+  header->size = size;
+  header->tag_count = tag_data->tag_count;
+  header->tags = sizeof (TagBlob);
+  memcpy (header->common, tag_data->common, sizeof (header->common));
+  header->cover_offset = tag_data->cover_offset;
+  header->cover_len = tag_data->cover_len;
+  header->cover_type = tag_data->cover_type;
+
+  TagBlobTag *tags = (TagBlobTag *)(blob + header->tags);
+  size_t pos = header->tags + tag_data->tag_count * sizeof (TagBlobTag);
+  for (i = 0; i < tag_data->tag_count; i++)
+    {
+    const Tag *tag = &tag_data->tags[i];
+    TagBlobTag *t = &tags[i];
+    memset (t, 0, sizeof (TagBlobTag));
+    t->id = tag_blob_put (blob, &pos, tag->frameId, strlen (tag->frameId));
+    t->data = tag_blob_put (blob, &pos, tag->data, tag->data_len);
+    t->data_len = tag->data_len;
+    t->key = tag->key;
+    t->type = tag->type;
+    t->utf8 = tag->utf8;
+    }
+  if (tag_data->cover_len)
+    header->cover_mime = tag_blob_put (blob, &pos, tag_data->cover_mime, 
+      strlen (tag_data->cover_mime));
+  if (tag_data->cover_file)
+    header->cover_file = tag_blob_put (blob, &pos, tag_data->cover_file, 
+      strlen (tag_data->cover_file));
+
+  *blob_ret = blob;
+  *len_ret = size;
+  return TAG_OK;
+  }
+
+/*
+ * Is there a zero-terminated string at offset, of len bytes if exact is
+ * TRUE? An offset of zero is allowed, and means that there is no string.
+ */
+static BOOL tag_blob_string_ok (const BYTE *blob, uint32_t size, 
+    uint32_t offset, uint32_t len, BOOL exact)
+  {
+  if (offset == 0) return len == 0;
+  if (offset < sizeof (TagBlob) || offset >= size 
+      || len >= size - offset) 
+    return FALSE;
+  if (exact) return blob[offset + len] == 0;
+  return memchr (blob + offset, 0, size - offset) != NULL;
+  }
+
+/*
+ * Check a serialized TagData, which may have come from anywhere, so that
+ * the tag_blob functions can trust it
+ */
+const TagBlob *tag_view (const void *blob, size_t len)
+  {
+  const BYTE *b = blob;
+  const TagBlob *header = blob;
+  if (len < sizeof (TagBlob) || memcmp (header->magic, TAG_BLOB_MAGIC, 4))
+    return NULL;
+  uint32_t size = header->size;
+  if (size > len || header->tags % 4 || header->tags < sizeof (TagBlob)
+      || header->tags > size
+      || header->tag_count > (size - header->tags) / sizeof (TagBlobTag))
+    return NULL;
+
+  const TagBlobTag *tags = (const TagBlobTag *)(b + header->tags);
+  uint32_t i;
+  for (i = 0; i < header->tag_count; i++)
+    {
+    if (!tags[i].id || !tags[i].data 
+        || !tag_blob_string_ok (b, size, tags[i].id, 0, FALSE)
+        || !tag_blob_string_ok (b, size, tags[i].data, tags[i].data_len, 
+          TRUE))
+      return NULL;
+    }
+
+  int c;
+  for (c = 0; c < TAG_COMMON_COUNT; c++)
+    if (header->common[c] < -1 
+        || header->common[c] >= (int64_t)header->tag_count)
+      return NULL;
+
+  if (!tag_blob_string_ok (b, size, header->cover_mime, 0, FALSE)
+      || !tag_blob_string_ok (b, size, header->cover_file, 0, FALSE))
+    return NULL;
+  return header;
+  }
+
+// Returns NULL if index is out of bounds
+const TagBlobTag *tag_blob_tag (const TagBlob *blob, int index)
+  {
+  if (index < 0 || (uint32_t)index >= blob->tag_count) return NULL;
+  return (const TagBlobTag *)((const BYTE *)blob + blob->tags) + index;
+  }
+
+// Returns NULL for an offset of zero
+const char *tag_blob_string (const TagBlob *blob, uint32_t offset)
+  {
+  if (!offset) return NULL;
+  return (const char *)blob + offset;
+  }
+
+/*
+ * The same as tag_get_common(), for a serialized TagData
+ */
+const char *tag_blob_common (const TagBlob *blob, TagCommonID id)
+  {
+  if (id < 0 || id >= TAG_COMMON_COUNT || blob->common[id] < 0) 
+    return NULL;
+  return tag_blob_string (blob, tag_blob_tag (blob, blob->common[id])->data);
+  }
 
@@ -7,6 +7,9 @@ Distributed under the terms of the GNU Public Licence, v3.0
   
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* Error codes. Methods that read tags of a particular type should
  * return TAG_NOXXX if the file is completely uninterpretable, or contains
  * no recognizable tags. These particular error codes mean that it might
@@ -26,6 +29,8 @@ typedef enum
   TAG_UNSUPFORMAT = 5, // Tag is a version we don't support
   TAG_NOVORBIS = 6, // File does not contain VORBIS comments 
   TAG_NOMP4 = 7, // File does not contain MP4 metadata 
+  TAG_NOCOVER = 8, // File does not contain a cover image
+  TAG_WRITEERROR = 9, // Can't write the cover image 
   } TagResult;
 
 // Tag types -- but only text is supported right now
@@ -39,6 +44,7 @@ typedef enum
 
 typedef enum
   {
+  TAG_COMMON_NONE = -1, // Not a common name
   TAG_COMMON_TITLE = 0,
   TAG_COMMON_ALBUM,
   TAG_COMMON_ARTIST,
@@ -51,23 +57,90 @@ typedef enum
   TAG_COMMON_ALBUM_ARTIST,
   } TagCommonID;
 
+#define TAG_COMMON_COUNT (TAG_COMMON_ALBUM_ARTIST + 1)
+
+#define TAG_COMMON_BIT(id) (1u << (id))
+
+/* A selection of tags for tag_get_tags_filtered(). A tag is wanted if its
+ * ID is in ids (matched regardless of case), or if it is one of the
+ * names of a common tag in common, which is made by OR-ing together 
+ * TAG_COMMON_BIT() values. If cover is TRUE, the cover image is located 
+ * as well. */
+typedef struct
+  {
+  const char *const *ids;
+  int n_ids;
+  unsigned int common;
+  BOOL cover;
+  } TagFilter;
+
+/* Vorbis comments, MP4 text, and ID3v2 UTF-8 frames are supposed to be
+ * UTF-8, but often are not. tag_utf8_repair says what to do with them;
+ * the default is to pass them on unchecked. Each such Tag's utf8 says 
+ * what was done. Text that the reader converts from another encoding is 
+ * not checked. */
+typedef enum
+  {
+  TAG_UTF8_TRUST = 0, // Don't check
+  TAG_UTF8_CHECK,     // Check, but leave invalid text as it is
+  TAG_UTF8_REPLACE,   // Replace each invalid byte with U+FFFD
+  TAG_UTF8_LATIN1     // Take invalid text to be ISO-8859-1
+  } TagUTF8Repair;
+
+typedef enum
+  {
+  TAG_UTF8_UNCHECKED = 0,
+  TAG_UTF8_VALID,
+  TAG_UTF8_INVALID,   // Invalid, and left as it is
+  TAG_UTF8_REPLACED,  // Invalid bytes were replaced with U+FFFD
+  TAG_UTF8_FROM_LATIN1 // Invalid, so converted from ISO-8859-1
+  } TagUTF8Status;
+
+// TagArena is the memory that a TagData's tags are allocated from
+typedef struct _TagArena TagArena;
+
+// TagPool holds strings that are shared between TagDatas
+typedef struct _TagPool TagPool;
+
 // Tag contains a reference to a specific tag's data
 typedef struct Tag
   {
   char *frameId;
   TagType type;
   unsigned char *data;
-  struct Tag *next;
+  int data_len; // Length of data in bytes, not including any terminator
+  BOOL is_view; // data points into a mapped file, and is not terminated
+  TagArena *arena; // Where a terminated copy of a view is made
+  unsigned int key; // frameId's first four characters, packed in upper case
+  TagUTF8Status utf8; // What tag_utf8_repair found, and did
   } Tag;
 
-// TagData holds a list of tags
+// TagData holds the tags read from a file
 typedef struct
   {
-  Tag *tag; // Head of a linked list of Tags  
-  // Cover art data, if present
-  unsigned char *cover;
-  int cover_len;
+  Tag *tags; // The tags, in the order they appear in the file
+  int tag_count;
+  int tag_capacity;
+  // For each TagCommonID, the index of the tag that supplies it, or -1,
+  //  and the rank of its name in order of preference
+  int common[TAG_COMMON_COUNT];
+  int common_rank[TAG_COMMON_COUNT];
+  // Cover art, if present. The image is not read with the tags -- this
+  //  is just where it is. Use tag_read_cover() to get it
+  unsigned char *cover; // The image, but only if it is already in memory
+  long long cover_offset; // Where the image starts in the file
+  int cover_len; // Length of the image, or zero if there is no cover
   char cover_mime[30];
+  int cover_type; // ID3v2/FLAC picture type; 3 is the front cover
+  char *cover_file; // The file that holds the image
+  // The mapped file, for tag_get_tags_mmap()
+  void *map;
+  size_t map_len;
+  // Where the TagData, its tags, and their values are allocated
+  TagArena *arena;
+  BOOL owns_arena; 
+  // Where tag names and values are interned, if anywhere
+  TagPool *pool;
   } TagData;
 
 /* NOTE: all functions that return a **tag_data_ret allocate a structure
@@ -81,14 +154,169 @@ TagResult            tag_get_ogg_tags
                         (const char *file, TagData **tag_data_ret);
 TagResult            tag_get_flac_tags 
                         (const char *file, TagData **tag_data_ret);
-int                  tag_get_tag_count (TagData *tag_data);
+TagResult            tag_get_mp4_tags 
+                        (const char *file, TagData **tag_data_ret);
+int                  tag_get_tag_count (const TagData *tag_data);
 void                 tag_free_tag_data (TagData *tag_data);
 Tag                 *tag_get_tag (const TagData *tag_data, int index);
 const unsigned char *tag_get_by_id (const TagData *tag_data, const char *id);
 const unsigned char *tag_get_common (const TagData *tag_data, TagCommonID id);
 TagResult            tag_get_tags (const char *file, TagData **tag_data_ret);
+TagResult            tag_get_tags_filtered (const char *file, 
+                        const TagFilter *filter, TagData **tag_data_ret);
+
+/* Each TagData normally has an arena of its own, which 
+ * tag_free_tag_data() frees. To read many files, it is quicker to 
+ * allocate them all from one arena, and reset it between files. A 
+ * TagData from tag_get_tags_in_arena() must still be passed to 
+ * tag_free_tag_data(), but its tags remain valid until the arena is 
+ * reset or freed. filter may be NULL, to read all the tags. */
+TagArena            *tag_arena_new (void);
+void                 tag_arena_reset (TagArena *arena);
+void                 tag_arena_free (TagArena *arena);
+TagResult            tag_get_tags_in_arena (const char *file, 
+                        const TagFilter *filter, TagArena *arena, 
+                        TagData **tag_data_ret);
+TagResult            tag_get_tags_mmap 
+                        (const char *file, TagData **tag_data_ret);
+
+/* A TagContext is the quickest way to read a batch of files. It keeps the
+ * memory used for one file to use for the next, so that after the first
+ * few files, reading tags allocates nothing. Each call to 
+ * tag_ctx_get_tags() invalidates the TagData from the previous call. A
+ * TagContext must only be used by one thread at a time. */
+typedef struct _TagContext TagContext;
+
+TagContext          *tag_ctx_new (void);
+void                 tag_ctx_free (TagContext *ctx);
+TagResult            tag_ctx_get_tags (TagContext *ctx, const char *file,
+                        const TagFilter *filter, TagData **tag_data_ret);
+
+/* Reading many files with a TagPool keeps only one copy of each tag name
+ * and value, however many files they are in. The TagData, its tags, and 
+ * their names and values are all allocated from the pool, and remain 
+ * valid until the pool is freed; tag_free_tag_data() does nothing to 
+ * them. A TagPool must only be used by one thread at a time. */
+TagPool             *tag_pool_new (void);
+void                 tag_pool_free (TagPool *pool);
+int                  tag_pool_count (const TagPool *pool);
+TagResult            tag_get_tags_pooled (const char *file, 
+                        const TagFilter *filter, TagPool *pool, 
+                        TagData **tag_data_ret);
+
+/* Whether a file that starts with buff is in a format that tags can be
+ * read from. The first TAG_SNIFF_SIZE bytes are enough to tell. */
+#define TAG_SNIFF_SIZE 8
+
+BOOL                 tag_sniff (const BYTE *buff, size_t len);
+
+/* These functions read tags from a complete file that is already in 
+ * memory. The tag values are copied, so the buffer can be discarded
+ * as soon as the function returns. */
+TagResult            tag_get_tags_from_buffer (const BYTE *buff, size_t len,
+                        TagData **tag_data_ret);
+TagResult            tag_get_id3v2_tags_from_buffer (const BYTE *buff, 
+                        size_t len, TagData **tag_data_ret);
+TagResult            tag_get_ogg_tags_from_buffer (const BYTE *buff, 
+                        size_t len, TagData **tag_data_ret);
+TagResult            tag_get_flac_tags_from_buffer (const BYTE *buff, 
+                        size_t len, TagData **tag_data_ret);
+TagResult            tag_get_mp4_tags_from_buffer (const BYTE *buff, 
+                        size_t len, TagData **tag_data_ret);
+
+/* To visit each tag in turn:
+ *   TagIterator iter; Tag *t;
+ *   tag_iter_init (&iter, tag_data);
+ *   while ((t = tag_iter_next (&iter))) ... */
+typedef struct
+  {
+  const TagData *tag_data;
+  int index;
+  } TagIterator;
+
+void                 tag_iter_init (TagIterator *iter, 
+                        const TagData *tag_data);
+Tag                 *tag_iter_next (TagIterator *iter);
+
+/* tag_get_value() gives a tag's value and its length as they are, which
+ * for a TagData from tag_get_tags_mmap() may not be zero-terminated. 
+ * tag_get_text(), and so tag_get_by_id() and tag_get_common(), make a 
+ * terminated copy of such a value the first time they are asked for it,
+ * allocating it from the TagData's arena, and change the tag to point to
+ * it. The copy is a cache, so they take a const TagData, but they need a
+ * lock if more than one thread can read the same TagData; tag_get_value()
+ * does not. */
+const unsigned char *tag_get_value (const Tag *tag, int *len);
+const unsigned char *tag_get_text (const Tag *tag);
+
+/* tag_serialize() packs a TagData into one block of memory, which the
+ * caller must free. The block has no pointers in it, only offsets from 
+ * its start, so it can be written to a file or a pipe, and used where it 
+ * is after it has been read back or mapped: tag_view() checks that a 
+ * block is sound, and returns its header, or NULL if it is not. Integers
+ * are in the byte order of the machine that made the block, and the 
+ * block must be aligned as malloc() would align it. The cover image is
+ * not included, only where it is. */
+#define TAG_BLOB_MAGIC "GTD1"
+
+typedef struct
+  {
+  char magic[4];        // TAG_BLOB_MAGIC
+  uint32_t size;        // Of the whole block
+  uint32_t tag_count;
+  uint32_t tags;        // Offset of the TagBlobTag table
+  int32_t common[TAG_COMMON_COUNT]; // As in TagData
+  int64_t cover_offset; // The cover fields are as in TagData, with the
+  uint32_t cover_len;   //  strings as offsets, or zero if there are none
+  int32_t cover_type;
+  uint32_t cover_mime;
+  uint32_t cover_file;
+  } TagBlob;
+
+typedef struct
+  {
+  uint32_t id;          // Offset of the zero-terminated frame ID
+  uint32_t data;        // Offset of the zero-terminated value
+  uint32_t data_len;
+  uint32_t key;
+  uint8_t type;         // TagType
+  uint8_t utf8;         // TagUTF8Status
+  uint16_t reserved;
+  } TagBlobTag;
+
+TagResult            tag_serialize (const TagData *tag_data, 
+                        void **blob_ret, size_t *len_ret);
+const TagBlob       *tag_view (const void *blob, size_t len);
+const TagBlobTag    *tag_blob_tag (const TagBlob *blob, int index);
+const char          *tag_blob_string (const TagBlob *blob, uint32_t offset);
+const char          *tag_blob_common (const TagBlob *blob, TagCommonID id);
+
+/* The cover image is not read with the tags, because it's usually large,
+ * and often not wanted. These functions get it from the file, which must
+ * not have changed in the meantime. They return TAG_NOCOVER if there is 
+ * no cover image. tag_read_cover() allocates a buffer for the image, 
+ * which the caller must free. */
+TagResult            tag_read_cover (const TagData *tag_data, 
+                        unsigned char **cover_ret, int *len_ret);
+TagResult            tag_copy_cover_to_fd (const TagData *tag_data, int fd);
 
 // Set tag_debug for copious debugging output
 extern BOOL tag_debug;
 
+// Set tag_utf8_repair before reading any tags
+extern TagUTF8Repair tag_utf8_repair;
+
+// Counts of the system calls made by the tag reader, since the program 
+//  started. These are only for information -- reset them at will. They
+//  are updated atomically, as files may be read on many threads at once
+typedef struct
+  {
+  long opens;
+  long reads;
+  long seeks;
+  long bytes_read;
+  } TagStats;
+
+extern TagStats tag_stats;
+
 
@@ -0,0 +1,563 @@
+/*==========================================================================
+gettags
+walk.c
+Copyright (c)2012-2024 Kevin Boone
+Distributed under the terms of the GNU Public Licence, v3.0
+==========================================================================*/
+
+/*
+ * The tree is walked on the calling thread, depth first, so that files
+ * are always reported in the same order. Reading a directory is what
+ * takes the time, though, particularly when it isn't cached, so when
+ * the walk goes into a directory, the first WALK_PREFETCH of its
+ * subdirectories are queued to be read by the other threads, and each
+ * time it goes into one of them, another is queued. When the walk gets
+ * to a directory that nobody has started on, it reads the directory
+ * itself.
+ *
+ * Each directory is opened relative to its parent, with openat(), so
+ * the kernel doesn't have to look up the whole path again. A directory
+ * is kept open only until all its subdirectories have been opened. In a
+ * deep tree, or one whose directories are read far ahead, that could be
+ * a lot of descriptors, so only so many are kept; the subdirectories of
+ * a directory that wasn't kept open are opened by their whole paths.
+ * If another thread runs out of descriptors all the same, it leaves the
+ * directory for the calling thread to read when it gets to it, by which
+ * time there should be fewer open.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "types.h"
+#include "walk.h"
+
+#ifndef _WIN32
+
+#define WALK_PREFETCH 16
+#define WALK_MAX_HELD 256
+#define WALK_BUFF_SIZE 32768
+
+typedef enum
+  {
+  WALK_NEW = 0,
+  WALK_QUEUED,
+  WALK_LISTING,
+  WALK_LISTED
+  } WalkState;
+
+typedef struct
+  {
+  const char *name;
+  BOOL is_dir;
+  } WalkEntry;
+
+typedef struct _WalkDir
+  {
+  struct _WalkDir *parent;
+  struct _WalkDir *next;  // In the queue
+  const char *name;   // Relative to the parent
+  char *path;         // For messages, and the paths of the files
+  int fd;             // Open until all the subdirectories have been opened,
+                      //  if it was kept open at all
+  int unopened;       // Subdirectories that have not been opened yet
+  WalkState state;
+  int error;
+  // Each entry is a byte that is TRUE for a directory, and the name
+  char *names;
+  size_t names_len;
+  WalkEntry *entries;
+  int count;
+  } WalkDir;
+
+typedef struct
+  {
+  const WalkFilter *filter;
+  // These are protected by lock
+  pthread_mutex_t lock;
+  pthread_cond_t queued;  // There are directories to read, or no more
+  pthread_cond_t listed;  // A directory has been read
+  WalkDir *head;
+  WalkDir *tail;
+  int held;           // Directories kept open for their subdirectories
+  int max_held;
+  BOOL finished;
+  } Walk;
+
+/*
+ * On Linux, the directory is read with the getdents64 system call,
+ * which fills a large buffer in one go, rather than with readdir().
+ * glibc only has a wrapper for it from version 2.30.
+ */
+#ifdef __linux__
+typedef struct
+  {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+  } WalkDirent;
+#endif
+
+/*
+ * Whether the filter wants a file
+ */
+static BOOL walk_wanted (const Walk *walk, int fd, const char *name)
+  {
+  const WalkFilter *filter = walk->filter;
+  if (filter->magic)
+    {
+    BYTE buff[64];
+    size_t len = filter->magic_len < sizeof (buff)
+      ? filter->magic_len : sizeof (buff);
+    int f = openat (fd, name, O_RDONLY | O_CLOEXEC);
+    if (f < 0) return FALSE;
+    ssize_t n = read (f, buff, len);
+    close (f);
+    return n > 0 && filter->magic (buff, n);
+    }
+
+  if (filter->n_exts == 0) return TRUE;
+  const char *ext = strrchr (name, '.');
+  if (!ext) return FALSE;
+  int i;
+  for (i = 0; i < filter->n_exts; i++)
+    if (strcasecmp (ext + 1, filter->exts[i]) == 0) return TRUE;
+  return FALSE;
+  }
+
+/*
+ * Add an entry to a directory's names, if it is a directory or a
+ * wanted file. Returns FALSE if we run out of memory.
+ */
+static BOOL walk_add_entry (const Walk *walk, WalkDir *dir, size_t *size,
+    const char *name, unsigned char type)
+  {
+  if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+    return TRUE;
+
+  struct stat sb;
+  if (type == DT_UNKNOWN)
+    {
+    if (fstatat (dir->fd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+      return TRUE;
+    if (S_ISDIR (sb.st_mode)) type = DT_DIR;
+    else if (S_ISREG (sb.st_mode)) type = DT_REG;
+    else if (S_ISLNK (sb.st_mode)) type = DT_LNK;
+    }
+  if (type == DT_LNK)
+    {
+    if (fstatat (dir->fd, name, &sb, 0) != 0 || !S_ISREG (sb.st_mode))
+      return TRUE;
+    type = DT_REG;
+    }
+  if (type == DT_DIR)
+    dir->unopened++;
+  else if (type != DT_REG || !walk_wanted (walk, dir->fd, name))
+    return TRUE;
+
+  size_t len = strlen (name) + 2;
+  if (dir->names_len + len > *size)
+    {
+    size_t new_size = *size ? *size * 2 : 4096;
+    while (new_size < dir->names_len + len) new_size *= 2;
+    char *names = realloc (dir->names, new_size);
+    if (!names) return FALSE;
+    dir->names = names;
+    *size = new_size;
+    }
+  dir->names[dir->names_len] = (type == DT_DIR);
+  memcpy (dir->names + dir->names_len + 1, name, len - 1);
+  dir->names_len += len;
+  dir->count++;
+  return TRUE;
+  }
+
+/*
+ * Read the entries of an open directory into its names. Returns zero or
+ * an errno value.
+ */
+static int walk_read_entries (const Walk *walk, WalkDir *dir)
+  {
+  size_t size = 0;
+#ifdef __linux__
+  char *buff = malloc (WALK_BUFF_SIZE);
+  if (!buff) return ENOMEM;
+  long n;
+  while ((n = syscall (SYS_getdents64, dir->fd, buff, WALK_BUFF_SIZE)) > 0)
+    {
+    long off = 0;
+    while (off < n)
+      {
+      WalkDirent *d = (WalkDirent *)(buff + off);
+      if (!walk_add_entry (walk, dir, &size, d->d_name, d->d_type))
+        {
+        free (buff);
+        return ENOMEM;
+        }
+      off += d->d_reclen;
+      }
+    }
+  free (buff);
+  return n < 0 ? errno : 0;
+#else
+  // readdir() closes the directory's descriptor, so give it a copy
+  int fd = dup (dir->fd);
+  DIR *d = fd < 0 ? NULL : fdopendir (fd);
+  if (!d)
+    {
+    int error = errno;
+    if (fd >= 0) close (fd);
+    return error;
+    }
+  struct dirent *de;
+  int error = 0;
+  while ((de = readdir (d)))
+    {
+    if (!walk_add_entry (walk, dir, &size, de->d_name, de->d_type))
+      {
+      error = ENOMEM;
+      break;
+      }
+    }
+  closedir (d);
+  return error;
+#endif
+  }
+
+static int walk_compare (const void *a, const void *b)
+  {
+  return strcmp (((const WalkEntry *)a)->name, ((const WalkEntry *)b)->name);
+  }
+
+/*
+ * Note that one of a directory's subdirectories has been opened, or
+ * won't be, and close the directory if it was the last
+ */
+static void walk_opened (Walk *walk, WalkDir *dir)
+  {
+  pthread_mutex_lock (&walk->lock);
+  if (--dir->unopened == 0 && dir->fd >= 0)
+    {
+    close (dir->fd);
+    dir->fd = -1;
+    walk->held--;
+    }
+  pthread_mutex_unlock (&walk->lock);
+  }
+
+/*
+ * Open and read a directory, and sort its entries. Nothing must be
+ * locked. If may_defer is TRUE, and there are no descriptors to be had,
+ * this returns FALSE, leaving the directory as it was, and its parent
+ * open.
+ */
+static BOOL walk_list (Walk *walk, WalkDir *dir, BOOL may_defer)
+  {
+  // The root is opened as it was given, even if it is a symbolic link
+  if (!dir->parent)
+    dir->fd = open (dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  else if (dir->parent->fd >= 0)
+    dir->fd = openat (dir->parent->fd, dir->name,
+      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  else
+    dir->fd = open (dir->path, 
+      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  dir->error = dir->fd < 0 ? errno : 0;
+  if (may_defer && (dir->error == EMFILE || dir->error == ENFILE)) 
+    return FALSE;
+
+  if (dir->parent) walk_opened (walk, dir->parent);
+  if (dir->error) return TRUE;
+
+  dir->error = walk_read_entries (walk, dir);
+  if (dir->error == 0 && dir->count > 0)
+    {
+    dir->entries = malloc (dir->count * sizeof (WalkEntry));
+    if (dir->entries)
+      {
+      size_t off = 0;
+      int i;
+      for (i = 0; i < dir->count; i++)
+        {
+        dir->entries[i].is_dir = dir->names[off];
+        dir->entries[i].name = dir->names + off + 1;
+        off += strlen (dir->entries[i].name) + 2;
+        }
+      qsort (dir->entries, dir->count, sizeof (WalkEntry), walk_compare);
+      }
+    else
+      dir->error = ENOMEM;
+    }
+
+  // The subdirectories won't be opened now
+  if (dir->error) dir->unopened = 0;
+  pthread_mutex_lock (&walk->lock);
+  if (dir->unopened > 0 && walk->held < walk->max_held)
+    walk->held++;
+  else
+    {
+    close (dir->fd);
+    dir->fd = -1;
+    }
+  pthread_mutex_unlock (&walk->lock);
+  return TRUE;
+  }
+
+static void *walk_thread (void *arg)
+  {
+  Walk *walk = arg;
+  pthread_mutex_lock (&walk->lock);
+  while (1)
+    {
+    while (!walk->head && !walk->finished)
+      pthread_cond_wait (&walk->queued, &walk->lock);
+    WalkDir *dir = walk->head;
+    if (!dir) break;
+    walk->head = dir->next;
+    if (!walk->head) walk->tail = NULL;
+    dir->state = WALK_LISTING;
+    pthread_mutex_unlock (&walk->lock);
+
+    BOOL listed = walk_list (walk, dir, TRUE);
+
+    pthread_mutex_lock (&walk->lock);
+    dir->state = listed ? WALK_LISTED : WALK_NEW;
+    pthread_cond_signal (&walk->listed);
+    }
+  pthread_mutex_unlock (&walk->lock);
+  return NULL;
+  }
+
+/*
+ * Queue a directory to be read by the other threads
+ */
+static void walk_queue (Walk *walk, WalkDir *dir)
+  {
+  pthread_mutex_lock (&walk->lock);
+  dir->state = WALK_QUEUED;
+  if (walk->tail)
+    walk->tail->next = dir;
+  else
+    walk->head = dir;
+  walk->tail = dir;
+  pthread_cond_signal (&walk->queued);
+  pthread_mutex_unlock (&walk->lock);
+  }
+
+/*
+ * Wait for a directory to be read or, if nobody has started on it, or
+ * the thread that did gave up, read it here
+ */
+static void walk_get (Walk *walk, WalkDir *dir)
+  {
+  pthread_mutex_lock (&walk->lock);
+  if (dir->state == WALK_QUEUED)
+    {
+    WalkDir **p = &walk->head, *prev = NULL;
+    while (*p != dir)
+      {
+      prev = *p;
+      p = &(*p)->next;
+      }
+    *p = dir->next;
+    if (walk->tail == dir) walk->tail = prev;
+    dir->state = WALK_NEW;
+    }
+  while (dir->state == WALK_LISTING)
+    pthread_cond_wait (&walk->listed, &walk->lock);
+  BOOL mine = dir->state == WALK_NEW;
+  if (mine) dir->state = WALK_LISTING;
+  pthread_mutex_unlock (&walk->lock);
+
+  if (mine)
+    {
+    walk_list (walk, dir, FALSE);
+    dir->state = WALK_LISTED;
+    }
+  }
+
+static WalkDir *walk_dir_new (WalkDir *parent, const char *name)
+  {
+  WalkDir *dir = calloc (1, sizeof (WalkDir));
+  if (!dir) return NULL;
+  dir->parent = parent;
+  dir->fd = -1;
+  if (parent)
+    {
+    size_t len = strlen (parent->path);
+    BOOL slash = len > 0 && parent->path[len - 1] != '/';
+    dir->path = malloc (len + slash + strlen (name) + 1);
+    if (dir->path)
+      sprintf (dir->path, "%s%s%s", parent->path, slash ? "/" : "", name);
+    dir->name = name;
+    }
+  else
+    dir->name = dir->path = strdup (name);
+  if (!dir->path)
+    {
+    free (dir);
+    return NULL;
+    }
+  return dir;
+  }
+
+static void walk_dir_free (WalkDir *dir)
+  {
+  free (dir->path);
+  free (dir->names);
+  free (dir->entries);
+  free (dir);
+  }
+
+/*
+ * Report the files in a directory, and walk its subdirectories
+ */
+static void walk_dir (Walk *walk, BOOL prefetch, WalkDir *dir,
+    WalkFunc func, void *data)
+  {
+  walk_get (walk, dir);
+  if (dir->error)
+    {
+    func (dir->path, dir->error, data);
+    return;
+    }
+
+  int i, n_subdirs = 0;
+  for (i = 0; i < dir->count; i++)
+    if (dir->entries[i].is_dir) n_subdirs++;
+  // Without room to keep the subdirectories, they are walked one at a 
+  //  time, without being read ahead
+  WalkDir **subdirs = NULL;
+  if (n_subdirs > 0 && !(subdirs = calloc (n_subdirs, sizeof (WalkDir *))))
+    prefetch = FALSE;
+  int s = 0;
+  if (subdirs)
+    for (i = 0; i < dir->count; i++)
+      if (dir->entries[i].is_dir)
+        subdirs[s++] = walk_dir_new (dir, dir->entries[i].name);
+  if (prefetch)
+    for (s = 0; s < n_subdirs && s < WALK_PREFETCH; s++)
+      if (subdirs[s]) walk_queue (walk, subdirs[s]);
+
+  size_t len = strlen (dir->path);
+  BOOL slash = len > 0 && dir->path[len - 1] != '/';
+  char *path = NULL;
+  size_t path_size = 0;
+  s = 0;
+  for (i = 0; i < dir->count; i++)
+    {
+    const WalkEntry *e = &dir->entries[i];
+    if (e->is_dir)
+      {
+      if (prefetch && s + WALK_PREFETCH < n_subdirs
+          && subdirs[s + WALK_PREFETCH])
+        walk_queue (walk, subdirs[s + WALK_PREFETCH]);
+      WalkDir *sub = subdirs ? subdirs[s++] : walk_dir_new (dir, e->name);
+      if (!sub)
+        {
+        walk_opened (walk, dir);
+        func (dir->path, ENOMEM, data);
+        continue;
+        }
+      walk_dir (walk, prefetch, sub, func, data);
+      walk_dir_free (sub);
+      }
+    else
+      {
+      size_t need = len + slash + strlen (e->name) + 1;
+      if (need > path_size)
+        {
+        char *p = realloc (path, need);
+        if (!p)
+          {
+          func (dir->path, ENOMEM, data);
+          continue;
+          }
+        path = p;
+        path_size = need;
+        }
+      sprintf (path, "%s%s%s", dir->path, slash ? "/" : "", e->name);
+      func (path, 0, data);
+      }
+    }
+  free (path);
+  free (subdirs);
+  }
+
+/*
+ * Walk the tree under dir -- see walk.h
+ */
+void walk_tree (const char *dir, int threads, const WalkFilter *filter,
+    WalkFunc func, void *data)
+  {
+  Walk walk;
+  memset (&walk, 0, sizeof (walk));
+  walk.filter = filter;
+  // Leave most of the descriptors for reading the files
+  struct rlimit rl;
+  walk.max_held = WALK_MAX_HELD;
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+      && rl.rlim_cur / 4 < WALK_MAX_HELD)
+    walk.max_held = rl.rlim_cur / 4;
+  pthread_mutex_init (&walk.lock, NULL);
+  pthread_cond_init (&walk.queued, NULL);
+  pthread_cond_init (&walk.listed, NULL);
+
+  pthread_t *tids = threads > 0 ? calloc (threads, sizeof (pthread_t)) : NULL;
+  int i, started = 0;
+  if (tids)
+    for (i = 0; i < threads; i++)
+      {
+      if (pthread_create (&tids[i], NULL, walk_thread, &walk) != 0) break;
+      started++;
+      }
+
+  WalkDir *root = walk_dir_new (NULL, dir);
+  if (root)
+    {
+    walk_dir (&walk, started > 0, root, func, data);
+    walk_dir_free (root);
+    }
+  else
+    func (dir, ENOMEM, data);
+
+  pthread_mutex_lock (&walk.lock);
+  walk.finished = TRUE;
+  pthread_cond_broadcast (&walk.queued);
+  pthread_mutex_unlock (&walk.lock);
+  for (i = 0; i < started; i++)
+    pthread_join (tids[i], NULL);
+  free (tids);
+
+  pthread_mutex_destroy (&walk.lock);
+  pthread_cond_destroy (&walk.queued);
+  pthread_cond_destroy (&walk.listed);
+  }
+
+#else
+
+/*
+ * There is no openat() on Windows
+ */
+void walk_tree (const char *dir, int threads, const WalkFilter *filter,
+    WalkFunc func, void *data)
+  {
+  func (dir, ENOSYS, data);
+  }
+
+#endif
@@ -0,0 +1,38 @@
+/*==========================================================================
+gettags
+walk.h
+Copyright (c)2012-2024 Kevin Boone
+Distributed under the terms of the GNU Public Licence, v3.0
+==========================================================================*/
+
+#pragma once
+
+#include <stddef.h>
+#include "types.h"
+
+/* Which files walk_tree() reports. A file is wanted if its name ends in
+ * one of the extensions, which are without the dot, and are compared
+ * without regard to case; or, if magic is not NULL, if magic() accepts
+ * its first magic_len bytes, whatever its name is. If there are no
+ * extensions and no magic, every file is wanted. */
+typedef struct
+  {
+  const char *const *exts;
+  int n_exts;
+  BOOL (*magic) (const BYTE *buff, size_t len);
+  size_t magic_len;
+  } WalkFilter;
+
+/* Called for each wanted file, with error zero, and for each directory
+ * that can't be read, with the errno value. */
+typedef void (*WalkFunc) (const char *path, int error, void *data);
+
+/* Walk a directory tree, calling func for each wanted file in the tree,
+ * in order of name within each directory, and depth first, on the
+ * calling thread. threads more threads read the directories ahead of
+ * the files being reported, which go on being reported while they
+ * are read. Symbolic links to files are followed, but not those to
+ * directories. */
+void       walk_tree (const char *dir, int threads, const WalkFilter *filter,
+              WalkFunc func, void *data);
+